@@ -46,6 +46,22 @@ module.exports = function (grunt)
                 cmd: "if [ \"$(lcov --rc lcov_branch_coverage=1 --list coverage/lcov_final.info | grep Total | grep -o '[0-9.]\\+%' | tr '\\n' ' ')\" != '100% 100% 100% ' ]; then exit 1; fi"
             },
 
+            // The harness is built with the simulator, in release mode like
+            // the baselines it's compared against
+            stress_build: {
+                cmd: 'npx node-gyp rebuild --simulate=true'
+            },
+
+            timer_wheel: {
+                cmd: './build/Release/timer_wheel',
+                stdio: 'inherit'
+            },
+
+            stress: {
+                cmd: './build/Release/stress --baseline test/stress_baseline.json',
+                stdio: 'inherit'
+            },
+
             documentation: {
                 cmd: [
                     'npx documentation build -c documentation.yml -f html -o docs lib/lora-comms.js',
@@ -77,6 +93,7 @@ module.exports = function (grunt)
                                     'exec:cover_lcov',
                                     'exec:cover_report',
                                     'exec:cover_check']);
+    grunt.registerTask('stress', ['exec:stress_build', 'exec:timer_wheel', 'exec:stress']);
     grunt.registerTask('docs', 'exec:documentation');
     grunt.registerTask('default', ['lint', 'test']);
 };
@@ -44,5 +44,38 @@
         ]
       ]
     }
+  ],
+  'conditions': [
+    [
+      'simulate == "true"',
+      {
+        'targets': [
+          {
+            # Stress and latency-regression harness for the queues; see
+            # test/stress.cc
+            "target_name": "stress",
+            "type": "executable",
+            "sources": [ "test/stress.cc", "test/simulate.cc" ],
+            "include_dirs": ["./src",
+                             "./packet_forwarder_shared/lora_pkt_fwd/inc"],
+            'cflags+': [ '-std=gnu++14', '-Wall', '-Wextra', '-Werror', '-pthread' ],
+            'cflags!': [ '-fno-exceptions' ],
+            'cflags_cc!': [ '-fno-exceptions', '-std=gnu++0x' ],
+            'ldflags': [ '-pthread' ]
+          },
+          {
+            # Unit test for the timer wheel; see test/timer_wheel.cc
+            "target_name": "timer_wheel",
+            "type": "executable",
+            "sources": [ "test/timer_wheel.cc" ],
+            "include_dirs": ["./src"],
+            'cflags+': [ '-std=gnu++14', '-Wall', '-Wextra', '-Werror', '-pthread' ],
+            'cflags!': [ '-fno-exceptions' ],
+            'cflags_cc!': [ '-fno-exceptions', '-std=gnu++0x' ],
+            'ldflags': [ '-pthread' ]
+          }
+        ]
+      }
+    ]
   ]
 }
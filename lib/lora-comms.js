@@ -9,20 +9,140 @@ process.env.UV_THREADPOOL_SIZE = (process.env.UV_THREADPOOL_SIZE || 4) + 5;
 
 const stream = require('stream'),
       path = require('path'),
+      fs = require('fs'),
       EventEmitter = require('events').EventEmitter,
       LoRaComms = require('bindings')('lora_comms').LoRaComms;
 
-LoRaComms.set_gw_send_hwm(LoRaComms.uplink, -1);
-LoRaComms.set_gw_send_timeout(LoRaComms.uplink, -1, -1);
-LoRaComms.set_gw_recv_timeout(LoRaComms.uplink, -1, -1);
+function timeout_args(ms)
+{
+    return ms < 0 ? [-1, -1] : [Math.floor(ms / 1000), (ms % 1000) * 1000];
+}
+
+// Settings currently applied, so reconfigure() can put back the ones it has
+// already changed if a later one fails. Link settings are kept across
+// restarts, which reset them in the shared library.
+const settings = {
+    uplink: { send_hwm: -1, send_timeout: -1, recv_timeout: -1, dedup: [0, 0, 0, false] },
+    downlink: { send_hwm: -1, send_timeout: -1, recv_timeout: -1 },
+    log: { max_msg_size: 1024, write_hwm: -1, write_timeout: -1 }
+};
+
+const setters = {
+    send_hwm: (link, hwm) => LoRaComms.set_gw_send_hwm(LoRaComms[link], hwm),
+    send_timeout: (link, ms) => LoRaComms.set_gw_send_timeout(LoRaComms[link], ...timeout_args(ms)),
+    recv_timeout: (link, ms) => LoRaComms.set_gw_recv_timeout(LoRaComms[link], ...timeout_args(ms)),
+    dedup: (link, args) => LoRaComms.set_uplink_dedup(...args),
+    max_msg_size: (log, size) => LoRaComms.set_log_max_msg_size(size),
+    write_hwm: (log, hwm) => LoRaComms.set_log_write_hwm(hwm),
+    write_timeout: (log, ms) => LoRaComms.set_log_write_timeout(...timeout_args(ms))
+};
+
+function apply_setting(group, name, value)
+{
+    setters[name](group, value);
+    settings[group][name] = value;
+}
+
+function apply_settings(group)
+{
+    for (let name in settings[group])
+    {
+        apply_setting(group, name, settings[group][name]);
+    }
+}
+
+apply_settings('uplink');
+apply_settings('downlink');
+apply_settings('log');
+
+// The forwarder only reads its configuration from a directory so in-memory
+// configuration is written to shared memory rather than disk.
+function write_config(config)
+{
+    if (!fs.existsSync('/dev/shm'))
+    {
+        throw new Error('in-memory config needs /dev/shm');
+    }
+
+    const dir = fs.mkdtempSync(path.join('/dev/shm', 'lora-comms-'));
+    try
+    {
+        fs.writeFileSync(path.join(dir, 'global_conf.json'),
+            (Buffer.isBuffer(config) || (typeof config === 'string')) ?
+                config : JSON.stringify(config));
+    }
+    catch (ex)
+    {
+        remove_config(dir);
+        throw ex;
+    }
+    return dir;
+}
+
+function remove_config(dir)
+{
+    try
+    {
+        fs.unlinkSync(path.join(dir, 'global_conf.json'));
+    }
+    catch (ex)
+    {
+        // writing it failed
+    }
+    fs.rmdirSync(dir);
+}
+
+function dev_addr_arg(dev_addr)
+{
+    if (Buffer.isBuffer(dev_addr))
+    {
+        return dev_addr.readUInt32BE(0);
+    }
+
+    if (typeof dev_addr === 'string')
+    {
+        return parseInt(dev_addr, 16);
+    }
+
+    return dev_addr;
+}
+
+// In the order the addon numbers them
+const queues = ['uplink', 'downlink', 'log_info', 'log_error'];
+
+// The queues belong to the process rather than to an instance, so the addon
+// has a single watermark callback, registered here, which emits on every
+// instance that's running or logging. Stopped instances are removed so they
+// can be garbage collected.
+const watermark_emitters = new Set();
+
+LoRaComms.set_watermark_callback((queue, high, packets, bytes) =>
+{
+    for (let emitter of watermark_emitters)
+    {
+        emitter.emit(high ? 'high_watermark' : 'low_watermark',
+                     queues[queue], { packets, bytes });
+    }
+});
 
-LoRaComms.set_gw_send_hwm(LoRaComms.downlink, -1);
-LoRaComms.set_gw_send_timeout(LoRaComms.downlink, -1, -1);
-LoRaComms.set_gw_recv_timeout(LoRaComms.downlink, -1, -1);
+const mic_statuses = ['ok', 'fail', 'unknown', 'none', 'invalid'];
 
-LoRaComms.set_log_max_msg_size(1024);
-LoRaComms.set_log_write_hwm(-1);
-LoRaComms.set_log_write_timeout(-1, -1);
+// Exact up to 2^53, which is plenty for timestamps.
+function read_uint64(buf, offset)
+{
+    return buf.readUInt32LE(offset + 4) * 0x100000000 + buf.readUInt32LE(offset);
+}
+
+function thread_args(options)
+{
+    const { cpus, policy, priority } = Object.assign(
+    {
+        cpus: [],
+        policy: 'other',
+        priority: 0
+    }, options);
+    return [cpus, LoRaComms[`sched_${policy}`], priority];
+}
 
 class LinkDuplex extends stream.Duplex
 {
@@ -114,6 +234,73 @@ class LogReadable extends stream.Readable
     }
 }
 
+class SubscriptionReadable extends stream.Readable
+{
+    constructor(link, policy, options)
+    {
+        super(options);
+        this._stats = null;
+        this._waiting = false;
+        this._id = LoRaComms.subscribe(link, policy, () =>
+        {
+            // Packets have arrived since the ring ran dry. If the stream
+            // has since stopped wanting more, _read() picks them up later.
+            if (this._waiting && !this.destroyed)
+            {
+                this._waiting = false;
+                this._pull();
+            }
+        });
+    }
+
+    _read()
+    {
+        this._waiting = false;
+        this._pull();
+    }
+
+    _pull()
+    {
+        while (true)
+        {
+            const r = LoRaComms.read_subscription(this._id);
+
+            if (r instanceof Error)
+            {
+                if (r.errno === LoRaComms.EAGAIN)
+                {
+                    this._waiting = true;
+                    return;
+                }
+
+                if (r.errno === LoRaComms.EBADF)
+                {
+                    return this.push(null);
+                }
+
+                return process.nextTick(() => this.emit('error', r));
+            }
+
+            if (!this.push(r))
+            {
+                return;
+            }
+        }
+    }
+
+    _destroy(err, cb)
+    {
+        this._stats = LoRaComms.get_subscription_stats(this._id);
+        LoRaComms.unsubscribe(this._id);
+        cb(err);
+    }
+
+    get stats()
+    {
+        return this._stats || LoRaComms.get_subscription_stats(this._id);
+    }
+}
+
 class lora_comms extends EventEmitter
 {
     get LoRaComms()
@@ -128,12 +315,25 @@ class lora_comms extends EventEmitter
         this._downlink = null;
         this._active = false;
         this._needs_reset = false;
+        this._dedup = false;
         this._log_info = null;
         this._log_error = null;
         this._logging_active = false;
         this._logging_needs_reset = false;
     }
 
+    _update_watermark_emitters()
+    {
+        if (this._active || this._logging_active)
+        {
+            watermark_emitters.add(this);
+        }
+        else
+        {
+            watermark_emitters.delete(this);
+        }
+    }
+
     /**
      * Start the LoRa radio, receiving and transmitting packets to
      * {@link lora-commsuplink|uplink} and {@link lora-commsdownlink|downlink}.
@@ -141,6 +341,31 @@ class lora_comms extends EventEmitter
      * @memberof lora-comms
      * @param {Object} options - Configuration options. This is passed to stream.Duplex when constructing {@link lora-commsuplink|uplink} and {@link lora-commsdownlink|downlink} and supports the following additional option:
      * @param {string} [options.cfg_dir] - Path to directory containing LoRa radio configuration files. Defaults to `packet_forwarder_shared/lora_pkt_fwd` in the module directory.
+     * @param {Object|Buffer|string} [options.config] - Radio configuration to use instead of the files in `cfg_dir`, in the format of `global_conf.json`. It's passed to the forwarder via shared memory (`/dev/shm`) so isn't written to disk; `start` throws if `/dev/shm` isn't available. The forwarder only reads configuration from files, so it's still written to a file there and parsed by the forwarder as usual; this saves disk I/O, not parsing.
+     * @param {Object|boolean} [options.dedup] - Remove duplicate frames from `PUSH_DATA` packets read from {@link lora-commsuplink|uplink}. Frames are duplicates if their PHYPayloads (including MIC) are the same. Pass `true` to use the defaults below.
+     * @param {integer} [options.dedup.capacity=1024] - Number of frames to remember.
+     * @param {integer} [options.dedup.window=200] - How long to remember each frame for, in milliseconds.
+     * @param {boolean} [options.dedup.merge=false] - If `false`, the first copy of a frame is passed on immediately and later copies are dropped. If `true`, the first copy is held until the window expires and then passed on in a new `PUSH_DATA` packet, with `rssi` and `lsnr` set to the best values received and `rcnt` set to the number of copies. `PUSH_DATA` packets which have all their frames removed are acknowledged for you. Frames still held when the radio stops are passed on straight away.
+     * @param {Object|boolean} [options.phy] - Decode the PHYPayload of each frame in `PUSH_DATA` packets read from {@link lora-commsuplink|uplink}, adding a `phy` property to its `rxpk` object. For data frames this has `mtype`, `major`, `dev_addr` (hex), `adr`, `adr_ack_req`, `ack`, `fpending`, `fcnt`, `fopts` (hex) and `fport` properties; for join requests `mtype`, `major`, `join_eui`, `dev_eui` and `dev_nonce`. It also has a `mic` property: `ok` or `fail` if the MIC of a data uplink was checked using a key registered with {@link lora-commsset_session|set_session}, `unknown` if there's no key for its DevAddr, `none` for other uplink frames (join and rejoin requests and proprietary frames) and `invalid` if the frame couldn't be decoded or is a downlink (join accept or downlink data), which a device would never send. Pass `true` to use the defaults below.
+     * @param {string} [options.phy.mode=mark] - `mark` just adds the `phy` property; `drop` also removes frames whose `mic` is `fail`, `unknown` or `invalid`, so unauthenticated data frames never reach your application. `PUSH_DATA` packets which have all their frames removed are acknowledged for you.
+     * @param {string} [options.format=gwmp] - Format of packets read from {@link lora-commsuplink|uplink}. `gwmp` delivers `PUSH_DATA` packets as received from the forwarder. `binary` delivers each received frame as a separate fixed-layout record instead, which is about half the size and much cheaper to decode than JSON; use {@link lora-commsdecode_uplink_record|decode_uplink_record} to read them. Frames with missing or invalid `data` are dropped and counted in {@link lora-commsformat_stats|format_stats}. `PUSH_DATA` packets are acknowledged for you unless they contain other data (e.g. `stat`), in which case that's delivered in a `PUSH_DATA` packet without `rxpk` for you to acknowledge as usual. Other packet types are delivered unchanged. Can't be used with `bridge`.
+     * @param {Object|boolean} [options.adaptive_hwm] - Bound the number of bytes waiting to be read from {@link lora-commsuplink|uplink} and {@link lora-commsdownlink|downlink} by how fast you read them, so packets which would wait longer than `latency` are dropped instead of queued. The rate is measured while packets are waiting; when you keep up, the bound relaxes towards `max`. Pass `true` to use the defaults below.
+     * @param {integer} [options.adaptive_hwm.latency=100] - Target latency in milliseconds.
+     * @param {integer} [options.adaptive_hwm.min=4096] - Lowest bound in bytes.
+     * @param {integer} [options.adaptive_hwm.max=1048576] - Highest bound in bytes.
+     * @param {Object|boolean} [options.broadcast] - Allow {@link lora-commssubscribe|subscribe} to be used. Pass `true` to use the defaults below.
+     * @param {integer} [options.broadcast.capacity=1024] - Number of packets each link keeps for its subscribers. A subscriber which falls this far behind is dealt with according to its `policy`. At most this many packets are kept for reading from {@link lora-commsuplink|uplink} and {@link lora-commsdownlink|downlink} too, so they don't build up if only subscribers are reading; further packets are dropped from the link (but still published to subscribers) until you read it.
+     * @param {Object|boolean} [options.forwarder_thread] - Run the packet forwarder on a dedicated thread instead of one from Node's threadpool. Threads the forwarder creates inherit its CPU affinity and scheduling policy. Pass `true` to use the defaults below.
+     * @param {integer[]} [options.forwarder_thread.cpus] - CPUs the thread may run on. Defaults to leaving its affinity alone.
+     * @param {string} [options.forwarder_thread.policy=other] - Scheduling policy: `other`, `fifo` or `rr`. Real-time policies usually need `CAP_SYS_NICE`.
+     * @param {integer} [options.forwarder_thread.priority=0] - Priority for the `fifo` and `rr` policies.
+     * @param {Object} [options.reader_thread] - CPU affinity (`cpus`) and scheduling (`policy` and `priority`) for the threads which read packets from the links when `dedup`, `phy`, `format: binary`, `broadcast`, `adaptive_hwm`, link {@link lora-commsset_watermarks|watermarks} or a {@link lora-commsset_memory_budget|memory budget} is used. Same format as `forwarder_thread`.
+     * @param {boolean} [options.mlockall=false] - Lock the process's memory while the radio is on, so the forwarder doesn't wait for pages to be faulted in. Locking applies to the whole process and all of it is unlocked when the radio stops, including any memory your application locked itself, so don't use this option if you call `mlockall` elsewhere.
+     * @param {Object} [options.bridge] - Exchange packets directly with a GWMP network server over UDP, without going through JavaScript. Packets from the forwarder aren't readable from {@link lora-commsuplink|uplink} and {@link lora-commsdownlink|downlink} (their readable sides end straight away) but can be observed using {@link lora-commssubscribe|subscribe}. Packets written to them are still sent to the forwarder.
+     * @param {string} options.bridge.address - IP address of the network server.
+     * @param {integer} [options.bridge.uplink_port=1700] - Network server port for {@link lora-commsuplink|uplink} packets.
+     * @param {integer} [options.bridge.downlink_port=1700] - Network server port for {@link lora-commsdownlink|downlink} packets.
+     * @param {integer} [options.bridge.batch=16] - Maximum number of packets sent or received per system call.
      */
     start(options)
     {
@@ -155,13 +380,115 @@ class lora_comms extends EventEmitter
             return;
         }
 
+        const format = options.format || 'gwmp';
+        if ((format !== 'gwmp') && (format !== 'binary'))
+        {
+            throw new Error(`invalid format: ${format}`);
+        }
+        if ((format === 'binary') && options.bridge)
+        {
+            throw new Error('binary format can\'t be used with bridge');
+        }
+
         if (this._needs_reset)
         {
             LoRaComms.reset();
+            apply_settings('uplink');
+            apply_settings('downlink');
+        }
+
+        const dedup = options.dedup === true ? {} : options.dedup;
+        this._dedup = !!dedup;
+        if (dedup)
+        {
+            const { capacity, window, merge } = Object.assign(
+            {
+                capacity: 1024,
+                window: 200,
+                merge: false
+            }, dedup);
+            if (!Number.isInteger(capacity) || (capacity < 1))
+            {
+                throw new Error(`invalid dedup.capacity: ${capacity}`);
+            }
+            if (!Number.isInteger(window) || (window < 0))
+            {
+                throw new Error(`invalid dedup.window: ${window}`);
+            }
+            apply_setting('uplink', 'dedup',
+                          [capacity, ...timeout_args(window), merge]);
         }
+        else
+        {
+            apply_setting('uplink', 'dedup', [0, 0, 0, false]);
+        }
+
+        const forwarder_thread = options.forwarder_thread === true ?
+            {} : options.forwarder_thread;
+        LoRaComms.set_forwarder_thread(!!forwarder_thread,
+                                       ...thread_args(forwarder_thread),
+                                       !!options.mlockall);
+        LoRaComms.set_reader_thread(LoRaComms.uplink,
+                                    ...thread_args(options.reader_thread));
+        LoRaComms.set_reader_thread(LoRaComms.downlink,
+                                    ...thread_args(options.reader_thread));
+
+        if (options.bridge)
+        {
+            const { address, uplink_port, downlink_port, batch } = Object.assign(
+            {
+                uplink_port: 1700,
+                downlink_port: 1700,
+                batch: 16
+            }, options.bridge);
+            LoRaComms.set_bridge(LoRaComms.uplink, address, uplink_port, batch);
+            LoRaComms.set_bridge(LoRaComms.downlink, address, downlink_port, batch);
+        }
+        else
+        {
+            LoRaComms.set_bridge(LoRaComms.uplink, '', 0, 0);
+            LoRaComms.set_bridge(LoRaComms.downlink, '', 0, 0);
+        }
+
+        const phy = options.phy === true ? {} : options.phy;
+        LoRaComms.set_uplink_phy(phy ?
+            LoRaComms[`phy_${phy.mode || 'mark'}`] : LoRaComms.phy_off);
+
+        LoRaComms.set_uplink_format(LoRaComms[`format_${format}`]);
+
+        const adaptive_hwm = options.adaptive_hwm === true ?
+            {} : options.adaptive_hwm;
+        const { latency, min, max } = Object.assign(
+        {
+            latency: 100,
+            min: 4096,
+            max: 1048576
+        }, adaptive_hwm);
+        for (let link of [LoRaComms.uplink, LoRaComms.downlink])
+        {
+            if (adaptive_hwm)
+            {
+                LoRaComms.set_adaptive_hwm(link, ...timeout_args(latency), min, max);
+            }
+            else
+            {
+                LoRaComms.set_adaptive_hwm(link, 0, 0, 0, 0);
+            }
+        }
+
+        const broadcast = options.broadcast === true ? {} : options.broadcast;
+        const { capacity } = Object.assign(
+        {
+            capacity: 1024
+        }, broadcast);
+        LoRaComms.set_broadcast(LoRaComms.uplink, broadcast ? capacity : 0);
+        LoRaComms.set_broadcast(LoRaComms.downlink, broadcast ? capacity : 0);
+
+        const config_dir = options.config ? write_config(options.config) : null;
 
         this._active = true;
         this._needs_reset = true;
+        this._update_watermark_emitters();
 
         if (options.no_streams)
         {
@@ -174,29 +501,197 @@ class lora_comms extends EventEmitter
             this._downlink = new LinkDuplex(LoRaComms.downlink, options);
         }
 
-        LoRaComms.start(options.cfg_dir, err => process.nextTick(() =>
+        let started = false;
+        try
+        {
+            LoRaComms.start(config_dir || options.cfg_dir, err => process.nextTick(() =>
+            {
+                this._active = false;
+                this._update_watermark_emitters();
+
+                if (config_dir)
+                {
+                    remove_config(config_dir);
+                }
+
+                if (this._uplink)
+                {
+                    this._uplink.push(null);
+                    this._uplink.end();
+                }
+
+                if (this._downlink)
+                {
+                    this._downlink.push(null);
+                    this._downlink.end();
+                }
+
+                if (err)
+                {
+                    this.emit('error', err);
+                }
+
+                this.emit('stop');
+            }));
+            started = true;
+        }
+        finally
         {
-            this._active = false;
+            if (!started)
+            {
+                this._active = false;
+                this._update_watermark_emitters();
+                if (config_dir)
+                {
+                    remove_config(config_dir);
+                }
+            }
+        }
+    }
 
-            if (this._uplink)
+    /**
+     * Change settings without restarting the radio. Every setting is checked
+     * before any are applied, and if applying one fails, those already
+     * applied are put back, so either all of them take effect or none do.
+     * Settings which aren't given are left alone. Timeouts are in
+     * milliseconds; -1 means wait forever.
+     *
+     * `log` and `dedup` settings can be changed while the radio is on.
+     * `uplink` and `downlink` settings are used by the forwarder's own threads
+     * so only reach it from the next {@link lora-commsstart|start}. However,
+     * when the addon reads a link itself (because `dedup`, `phy`,
+     * `format: binary`, `broadcast`, {@link lora-commsset_watermarks|watermarks},
+     * `adaptive_hwm` or a {@link lora-commsset_memory_budget|memory budget} is
+     * used), its `send_hwm` and `send_timeout` also apply to the queue you
+     * read the link from, and can be changed while the radio is on.
+     * `recv_timeout`, and the other link settings when the addon doesn't read
+     * the link, can only be changed while the radio is off.
+     *
+     * @memberof lora-comms
+     * @param {Object} options - Settings to change.
+     * @param {Object} [options.uplink] - Settings for packets on {@link lora-commsuplink|uplink}.
+     * @param {integer} [options.uplink.send_hwm] - Number of bytes the forwarder may queue before it waits (-1 for no limit). Limited to the link's share of any {@link lora-commsset_memory_budget|memory budget}.
+     * @param {integer} [options.uplink.send_timeout] - How long the forwarder waits once `send_hwm` is reached.
+     * @param {integer} [options.uplink.recv_timeout] - How long the forwarder waits for packets written to the link.
+     * @param {Object} [options.downlink] - Settings for packets on {@link lora-commsdownlink|downlink}, as for `uplink`.
+     * @param {Object} [options.log] - Settings for diagnostic messages.
+     * @param {integer} [options.log.write_hwm] - Number of bytes which may be queued before the forwarder waits (-1 for no limit).
+     * @param {integer} [options.log.write_timeout] - How long the forwarder waits once `write_hwm` is reached.
+     * @param {integer} [options.log.max_msg_size] - Messages longer than this are truncated.
+     * @param {Object|boolean} [options.dedup] - New deduplication settings, as for {@link lora-commsstart|start}. Pass `false` to stop removing duplicates. Deduplication can only be changed if it was enabled when the radio was started. Frames seen recently are kept when the capacity changes, unless it becomes too small to hold them or deduplication is turned off.
+     */
+    reconfigure(options)
+    {
+        const changes = [];
+
+        function check(value, name, min)
+        {
+            if (!Number.isInteger(value) || (value < min))
             {
-                this._uplink.push(null);
-                this._uplink.end();
+                throw new Error(`invalid ${name}: ${value}`);
             }
+            return value;
+        }
 
-            if (this._downlink)
+        for (let link of ['uplink', 'downlink'])
+        {
+            const link_settings = options[link] || {};
+            for (let name of ['send_hwm', 'send_timeout', 'recv_timeout'])
             {
-                this._downlink.push(null);
-                this._downlink.end();
+                if (link_settings[name] !== undefined)
+                {
+                    if (this._active &&
+                        ((name === 'recv_timeout') ||
+                         !LoRaComms.is_link_reader_active(LoRaComms[link])))
+                    {
+                        throw new Error(`${link}.${name} can't be changed while the radio is on`);
+                    }
+                    changes.push([link, name, check(link_settings[name], `${link}.${name}`, -1)]);
+                }
             }
+        }
 
-            if (err)
+        const log = options.log || {};
+        if (log.write_hwm !== undefined)
+        {
+            changes.push(['log', 'write_hwm', check(log.write_hwm, 'log.write_hwm', -1)]);
+        }
+        if (log.write_timeout !== undefined)
+        {
+            changes.push(['log', 'write_timeout', check(log.write_timeout, 'log.write_timeout', -1)]);
+        }
+        if (log.max_msg_size !== undefined)
+        {
+            changes.push(['log', 'max_msg_size', check(log.max_msg_size, 'log.max_msg_size', 1)]);
+        }
+
+        if (options.dedup !== undefined)
+        {
+            if (!this._dedup)
+            {
+                throw new Error('dedup was not enabled by start');
+            }
+            const { capacity, window, merge } = Object.assign(
+            {
+                capacity: 1024,
+                window: 200,
+                merge: false
+            }, options.dedup === true ? {} : options.dedup);
+            check(capacity, 'dedup.capacity', 1);
+            check(window, 'dedup.window', 0);
+            changes.push(['uplink', 'dedup', [options.dedup ? capacity : 0,
+                                              ...timeout_args(window),
+                                              merge]]);
+        }
+
+        const applied = [];
+        try
+        {
+            for (let [group, name, value] of changes)
+            {
+                const previous = settings[group][name];
+                apply_setting(group, name, value);
+                applied.push([group, name, previous]);
+            }
+        }
+        catch (ex)
+        {
+            for (let [group, name, previous] of applied.reverse())
             {
-                this.emit('error', err);
+                apply_setting(group, name, previous);
             }
+            throw ex;
+        }
+    }
 
-            this.emit('stop');
-        }));
+    /**
+     * Time taken for the radio to start, in milliseconds. Has a `forwarder`
+     * property, the time from {@link lora-commsstart|start} being called to
+     * the packet forwarder being run, and a `first_packet` property, the
+     * time until the first packet was read from it. Each is `null` until it
+     * happens.
+     *
+     * `forwarder` stops when the forwarder is called, so it covers starting
+     * its thread but not parsing its configuration or setting up the radio.
+     * The forwarder doesn't report when it's ready; the first packet it sends
+     * (normally `PULL_DATA` on {@link lora-commsdownlink|downlink}) is the
+     * earliest sign, so use `first_packet` for that. It includes any delay in
+     * reading the packet.
+     *
+     * @memberof lora-comms
+     * @type {Object}
+     */
+    get startup_latency()
+    {
+        const latency = LoRaComms.get_startup_latency();
+        for (let name of ['forwarder', 'first_packet'])
+        {
+            if (latency[name] !== null)
+            {
+                latency[name] /= 1000;
+            }
+        }
+        return latency;
     }
 
 	/**
@@ -237,6 +732,402 @@ class lora_comms extends EventEmitter
         return this._downlink;
     }
 
+    /**
+     * Subscribe to the packets read from a link. Any number of subscribers
+     * can read the same packets alongside {@link lora-commsuplink|uplink} or
+     * {@link lora-commsdownlink|downlink} without slowing each other down
+     * (unless `policy` is `block`). Packets aren't copied for each
+     * subscriber so the Buffers read from the stream mustn't be modified.
+     *
+     * The radio must have been started with the `broadcast` option. The
+     * stream ends when the radio stops. Destroy the stream to unsubscribe.
+     *
+     * The stream has a `stats` property containing the number of packets
+     * `received` and `dropped`, its current and maximum `lag` (number of
+     * unread packets) and whether it was `disconnected`.
+     *
+     * @memberof lora-comms
+     * @param {string} link - `uplink` or `downlink`.
+     * @param {Object} [options] - Configuration options. This is passed to stream.Readable and supports the following additional option:
+     * @param {string} [options.policy=drop] - What to do when the subscriber falls `broadcast.capacity` packets behind: `block` waits for it to catch up, holding up all other readers of the link; `drop` discards its oldest unread packet; `disconnect` ends the stream with an `ECONNRESET` error.
+     * @returns {stream.Readable} Stream of packets.
+     */
+    subscribe(link, options)
+    {
+        if ((link !== 'uplink') && (link !== 'downlink'))
+        {
+            throw new Error(`invalid link: ${link}`);
+        }
+
+        options = Object.assign(
+        {
+            policy: 'drop'
+        }, options);
+
+        if (!['block', 'drop', 'disconnect'].includes(options.policy))
+        {
+            throw new Error(`invalid policy: ${options.policy}`);
+        }
+
+        return new SubscriptionReadable(LoRaComms[link],
+                                        LoRaComms[`policy_${options.policy}`],
+                                        options);
+    }
+
+    /**
+     * Uplink deduplication statistics, if `dedup` was passed to
+     * {@link lora-commsstart|start}.
+     *
+     * @memberof lora-comms
+     * @type {Object}
+     * @property {integer} frames - Number of frames received.
+     * @property {integer} duplicates - Number of frames which were duplicates.
+     * @property {integer} evictions - Number of frames forgotten before their window expired because the table was full.
+     * @property {integer} held - Number of frames waiting for their window to expire (merge mode only).
+     */
+    get dedup_stats()
+    {
+        return LoRaComms.get_uplink_dedup_stats();
+    }
+
+    /**
+     * Register the network session key of an activated device so the MICs of
+     * its uplink frames can be verified when the `phy` option is passed to
+     * {@link lora-commsstart|start}. Can be called at any time.
+     *
+     * @memberof lora-comms
+     * @param {Buffer|string|integer} dev_addr - Device address, as 4 bytes (most significant first), a hex string or a number.
+     * @param {Buffer} nwk_s_key - 16 byte network session key.
+     * @param {integer} [fcnt_up=0] - Last uplink frame counter received from the device. Frames only carry the least significant 16 bits of the counter; the rest come from here and are updated as frames are verified.
+     */
+    set_session(dev_addr, nwk_s_key, fcnt_up)
+    {
+        LoRaComms.set_session(dev_addr_arg(dev_addr), nwk_s_key, fcnt_up || 0);
+    }
+
+    /**
+     * Forget a device's network session key.
+     *
+     * @memberof lora-comms
+     * @param {Buffer|string|integer} dev_addr - Device address, as for {@link lora-commsset_session|set_session}.
+     */
+    remove_session(dev_addr)
+    {
+        LoRaComms.remove_session(dev_addr_arg(dev_addr));
+    }
+
+    /**
+     * Forget all network session keys.
+     *
+     * @memberof lora-comms
+     */
+    clear_sessions()
+    {
+        LoRaComms.clear_sessions();
+    }
+
+    /**
+     * Statistics for the `phy` option passed to {@link lora-commsstart|start}.
+     *
+     * @memberof lora-comms
+     * @type {Object}
+     * @property {integer} frames - Number of frames decoded.
+     * @property {integer} ok - Number of frames whose MIC was verified.
+     * @property {integer} failed - Number of frames whose MIC was wrong.
+     * @property {integer} unknown - Number of data uplinks from devices without a session.
+     * @property {integer} invalid - Number of frames which couldn't be decoded.
+     * @property {integer} dropped - Number of frames removed in `drop` mode.
+     * @property {integer} sessions - Number of sessions registered.
+     */
+    get phy_stats()
+    {
+        return LoRaComms.get_uplink_phy_stats();
+    }
+
+    /**
+     * Statistics for the `binary` format passed to
+     * {@link lora-commsstart|start}.
+     *
+     * @memberof lora-comms
+     * @type {Object}
+     * @property {integer} records - Number of records delivered.
+     * @property {integer} invalid - Number of frames dropped because their `rxpk` object had missing or invalid `data`.
+     */
+    get format_stats()
+    {
+        return LoRaComms.get_uplink_format_stats();
+    }
+
+    /**
+     * Decode a record read from {@link lora-commsuplink|uplink} when the
+     * `binary` format is passed to {@link lora-commsstart|start}. Fields have
+     * the same units as their `rxpk` counterparts in `PUSH_DATA` packets.
+     *
+     * Records have a 56 byte header followed by the PHYPayload. Multi-byte
+     * fields are little-endian:
+     *
+     * | Offset | Size | Field |
+     * |--------|------|-------|
+     * | 0 | 1 | version (`0x81`) |
+     * | 1 | 1 | flags: `1` time valid, `2` tmms valid, `4` FSK modulation |
+     * | 2 | 1 | stat (signed) |
+     * | 3 | 1 | chan |
+     * | 4 | 1 | rfch |
+     * | 5 | 1 | LoRa spreading factor |
+     * | 6 | 1 | LoRa coding rate denominator |
+     * | 7 | 1 | mic: `0` not decoded, then `ok`, `fail`, `unknown`, `none`, `invalid` |
+     * | 8 | 4 | tmst |
+     * | 12 | 4 | frequency in Hz |
+     * | 16 | 4 | LoRa bandwidth in Hz or FSK bitrate |
+     * | 20 | 2 | rssi (signed) |
+     * | 22 | 2 | PHYPayload size |
+     * | 24 | 4 | lsnr (float) |
+     * | 28 | 8 | time, microseconds since the epoch |
+     * | 36 | 8 | tmms |
+     * | 44 | 8 | gateway EUI |
+     * | 52 | 2 | rcnt |
+     * | 54 | 2 | reserved |
+     *
+     * @memberof lora-comms
+     * @param {Buffer} buf - Packet read from {@link lora-commsuplink|uplink}.
+     * @returns {?Object} The record's fields or `null` if `buf` isn't a record (for example, a GWMP packet). Has `tmst`, `time` (a Date or `null`), `tmms` (or `null`), `freq` (MHz), `chan`, `rfch`, `stat`, `modu`, `datr`, `codr` (`null` for FSK), `rssi`, `lsnr` (`null` for FSK), `size`, `data` (a Buffer sharing memory with `buf`), `eui` (hex), `rcnt` and `mic` (`null` unless the `phy` option was used) properties.
+     */
+    decode_uplink_record(buf)
+    {
+        const header_size = LoRaComms.record_header_size;
+        if ((buf.length < header_size) ||
+            (buf[0] !== LoRaComms.record_version))
+        {
+            return null;
+        }
+        const size = buf.readUInt16LE(22);
+        if (buf.length < header_size + size)
+        {
+            return null;
+        }
+
+        const flags = buf[1];
+        const fsk = (flags & 4) !== 0;
+        const bw = buf.readUInt32LE(16);
+        const codr = buf[6];
+        const mic = buf[7];
+
+        return {
+            tmst: buf.readUInt32LE(8),
+            time: (flags & 1) ? new Date(Math.floor(read_uint64(buf, 28) / 1000)) : null,
+            tmms: (flags & 2) ? read_uint64(buf, 36) : null,
+            freq: buf.readUInt32LE(12) / 1e6,
+            chan: buf[3],
+            rfch: buf[4],
+            stat: buf.readInt8(2),
+            modu: fsk ? 'FSK' : 'LORA',
+            datr: fsk ? bw : `SF${buf[5]}BW${bw / 1000}`,
+            codr: codr ? `4/${codr}` : null,
+            rssi: buf.readInt16LE(20),
+            lsnr: fsk ? null : Math.round(buf.readFloatLE(24) * 100) / 100,
+            size,
+            data: buf.slice(header_size, header_size + size),
+            eui: buf.toString('hex', 44, 52),
+            rcnt: buf.readUInt16LE(52),
+            mic: mic ? mic_statuses[mic - 1] : null
+        };
+    }
+
+    /**
+     * Statistics for the `bridge` passed to {@link lora-commsstart|start}.
+     * Has `uplink` and `downlink` properties, each with the following
+     * properties:
+     *
+     * @memberof lora-comms
+     * @type {Object}
+     * @property {integer} sent - Number of packets sent to the network server.
+     * @property {integer} received - Number of packets received from the network server.
+     * @property {integer} send_batches - Number of calls to `sendmmsg`.
+     * @property {integer} recv_batches - Number of calls to `recvmmsg`.
+     * @property {integer} send_errors - Number of failed calls to `sendmmsg`. Packets in a failed batch are dropped.
+     * @property {integer} recv_errors - Number of failed calls to `recvmmsg`.
+     */
+    get bridge_stats()
+    {
+        return {
+            uplink: LoRaComms.get_bridge_stats(LoRaComms.uplink),
+            downlink: LoRaComms.get_bridge_stats(LoRaComms.downlink)
+        };
+    }
+
+    /**
+     * Effective CPU affinity and scheduling of the threads started by
+     * {@link lora-commsstart|start}. Has `forwarder`, `uplink_reader` and
+     * `downlink_reader` properties, which are `null` if the thread hasn't run,
+     * otherwise have the following properties. `forwarder` is only set when
+     * the `forwarder_thread` option is used. Also has a `memory_locked`
+     * property and a `memory_lock_error` property (`null` unless `mlockall`
+     * failed).
+     *
+     * @memberof lora-comms
+     * @type {Object}
+     * @property {integer[]} cpus - CPUs the thread may run on.
+     * @property {string} policy - Scheduling policy (`other`, `fifo` or `rr`).
+     * @property {integer} priority - Priority for real-time policies.
+     * @property {Error} affinity_error - `null` unless the requested CPUs couldn't be set.
+     * @property {Error} sched_error - `null` unless the requested policy couldn't be set.
+     */
+    get thread_settings()
+    {
+        const settings = LoRaComms.get_thread_settings();
+        const policies = {};
+        for (let policy of ['other', 'fifo', 'rr'])
+        {
+            policies[LoRaComms[`sched_${policy}`]] = policy;
+        }
+        for (let thread of ['forwarder', 'uplink_reader', 'downlink_reader'])
+        {
+            if (settings[thread])
+            {
+                settings[thread].policy = policies[settings[thread].policy] ||
+                                          settings[thread].policy;
+            }
+        }
+        return settings;
+    }
+
+    /**
+     * Limit the memory used to hold packets and log messages which haven't
+     * been read yet. The limit applies to the whole process.
+     *
+     * Each queue (`uplink`, `downlink`, `log_info` and `log_error`) may use
+     * up to its share of the budget. When the budget as a whole is exhausted,
+     * the oldest messages in queues with a lower priority are discarded to
+     * make room (packets still held for {@link lora-commssubscribe|subscribers}
+     * aren't discarded, since that wouldn't free anything). Messages which
+     * still don't fit are dropped.
+     *
+     * Call before {@link lora-commsstart|start}. The budget also bounds the
+     * `send_hwm` of each link (see {@link lora-commsreconfigure|reconfigure})
+     * from the next start, without replacing the value you set.
+     *
+     * @memberof lora-comms
+     * @param {integer} bytes - Size of the budget. Pass 0 for no limit.
+     * @param {Object} [options] - Configuration options.
+     * @param {Object} [options.shares] - Fraction of the budget each queue may use, greater than 0. Defaults to `{ uplink: 0.5, downlink: 0.5, log_info: 0.25, log_error: 0.25 }`. However small its share, a link always lets at least one packet wait in the forwarder.
+     * @param {Object} [options.priorities] - Priority of each queue. Defaults to `{ uplink: 2, downlink: 2, log_info: 0, log_error: 1 }`, i.e. informational messages are discarded first, then error messages.
+     */
+    set_memory_budget(bytes, options)
+    {
+        options = options || {};
+        const shares = Object.assign(
+        {
+            uplink: 0.5,
+            downlink: 0.5,
+            log_info: 0.25,
+            log_error: 0.25
+        }, options.shares);
+        const priorities = Object.assign(
+        {
+            uplink: 2,
+            downlink: 2,
+            log_info: 0,
+            log_error: 1
+        }, options.priorities);
+
+        if (!Number.isInteger(bytes) || (bytes < 0))
+        {
+            throw new Error(`invalid budget: ${bytes}`);
+        }
+        for (let queue of queues)
+        {
+            if ((typeof shares[queue] !== 'number') || !(shares[queue] > 0))
+            {
+                throw new Error(`invalid ${queue} share: ${shares[queue]}`);
+            }
+        }
+
+        LoRaComms.set_memory_budget(bytes,
+                                    queues.map(a => shares[a]),
+                                    queues.map(a => priorities[a]));
+    }
+
+    /**
+     * Emit {@link lora-commsevent:high_watermark|high_watermark} when a
+     * queue's length reaches a high watermark and then
+     * {@link lora-commsevent:low_watermark|low_watermark} once it's back at
+     * or below the low watermarks. Watermarks can be given in packets, bytes
+     * or both; the queue is congested when either high watermark is reached
+     * and recovers when it's at or below all the low ones.
+     *
+     * Watermarks for `uplink` and `downlink` must be set before
+     * {@link lora-commsstart|start} is called, since they need packets to be
+     * read from the forwarder on a separate thread.
+     *
+     * @memberof lora-comms
+     * @param {string} queue - `uplink`, `downlink`, `log_info` or `log_error`.
+     * @param {?Object} options - Watermarks. Pass `null` to stop emitting events for the queue.
+     * @param {integer} [options.high_packets] - High watermark in packets.
+     * @param {integer} [options.low_packets] - Low watermark in packets. Defaults to half of `high_packets`.
+     * @param {integer} [options.high_bytes] - High watermark in bytes.
+     * @param {integer} [options.low_bytes] - Low watermark in bytes. Defaults to half of `high_bytes`.
+     */
+    set_watermarks(queue, options)
+    {
+        const index = queues.indexOf(queue);
+        if (index < 0)
+        {
+            throw new Error(`invalid queue: ${queue}`);
+        }
+
+        const { low_packets, high_packets, low_bytes, high_bytes } = Object.assign(
+        {
+            high_packets: -1,
+            high_bytes: -1
+        }, options);
+
+        LoRaComms.set_watermarks(
+            index,
+            low_packets === undefined ? Math.floor(high_packets / 2) : low_packets,
+            high_packets,
+            low_bytes === undefined ? Math.floor(high_bytes / 2) : low_bytes,
+            high_bytes);
+    }
+
+    /**
+     * Current length of each queue of unread packets and log messages. Has
+     * `uplink`, `downlink`, `log_info` and `log_error` properties, each with
+     * the following properties. `uplink` and `downlink` are only used when
+     * packets are read from the forwarder on a separate thread (see
+     * {@link lora-commsstart|start}), otherwise they're always empty.
+     *
+     * @memberof lora-comms
+     * @type {Object}
+     * @property {integer} packets - Number of messages in the queue.
+     * @property {integer} bytes - Size of the messages in the queue.
+     * @property {boolean} congested - Whether the queue has reached a high watermark and not yet fallen back to the low ones (see {@link lora-commsset_watermarks|set_watermarks}).
+     * @property {integer} hwm - `uplink` and `downlink` only: the current `adaptive_hwm` bound in bytes, or -1.
+     * @property {number} drain_rate - `uplink` and `downlink` only: the rate you've been reading packets at, in bytes per second, or -1 if it hasn't been measured.
+     * @property {integer} dropped - `uplink` and `downlink` only: number of packets dropped because of `adaptive_hwm`, the link's `send_hwm` (see {@link lora-commsreconfigure|reconfigure}) or because `broadcast.capacity` packets were already waiting.
+     */
+    get queue_stats()
+    {
+        return LoRaComms.get_queue_stats();
+    }
+
+    /**
+     * Memory used by unread packets and log messages. Has `budget` and `used`
+     * properties for the whole process and `uplink`, `downlink`, `log_info`
+     * and `log_error` properties, each with the following properties:
+     *
+     * @memberof lora-comms
+     * @type {Object}
+     * @property {integer} used - Bytes held in the queue.
+     * @property {integer} limit - Bytes the queue may hold.
+     * @property {integer} priority - Priority of the queue.
+     * @property {integer} dropped - Number of messages dropped because they didn't fit.
+     * @property {integer} shed - Number of messages discarded to make room for queues with a higher priority.
+     */
+    get memory_usage()
+    {
+        return LoRaComms.get_memory_usage();
+    }
+
     /**
      * Whether the LoRa radio is switched on.
      *
@@ -270,6 +1161,7 @@ class lora_comms extends EventEmitter
 
         this._logging_active = true;
         this._logging_needs_reset = true;
+        this._update_watermark_emitters();
 
         this._log_info = new LogReadable(LoRaComms.get_log_info_message,
                                          options);
@@ -281,6 +1173,7 @@ class lora_comms extends EventEmitter
             if (++end_count === 2)
             {
                 this._logging_active = false;
+                this._update_watermark_emitters();
                 this.emit('logging_stop');
             }
         };
@@ -352,6 +1245,24 @@ class lora_comms extends EventEmitter
      * @event logging_stop
      */
 
+    /**
+     * High watermark event. Emitted when a queue becomes congested.
+     *
+     * @memberof lora-comms
+     * @event high_watermark
+     * @param {string} queue - `uplink`, `downlink`, `log_info` or `log_error`.
+     * @param {Object} length - The queue's length when it became congested, in `packets` and `bytes`.
+     */
+
+    /**
+     * Low watermark event. Emitted when a congested queue recovers.
+     *
+     * @memberof lora-comms
+     * @event low_watermark
+     * @param {string} queue - `uplink`, `downlink`, `log_info` or `log_error`.
+     * @param {Object} length - The queue's length when it recovered, in `packets` and `bytes`.
+     */
+
     /**
      * Error event.
      *
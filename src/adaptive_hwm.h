@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <sys/types.h>
+
+using namespace std::chrono_literals;
+
+// High-water mark for a queue which follows how fast its consumer drains it.
+//
+// The bound is the number of bytes the consumer can read within the target
+// latency, so packets which would wait longer than that are refused rather
+// than queued. The drain rate is only sampled while there's a backlog;
+// when the consumer keeps up the rate it reads at is just the arrival rate,
+// so instead the bound is relaxed towards its maximum.
+class AdaptiveHwm
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    // A target of zero disables the bound.
+    void configure(const std::chrono::microseconds& target,
+                   const size_t min_bytes,
+                   const size_t max_bytes)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        this->target = target;
+        this->min_bytes = std::max(min_bytes, static_cast<size_t>(1));
+        this->max_bytes = std::max(max_bytes, this->min_bytes);
+        reset_locked();
+    }
+
+    void reset()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        reset_locked();
+    }
+
+    bool enabled()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        return target > 0us;
+    }
+
+    // Called by the consumer for each packet it reads
+    void drained(const size_t bytes)
+    {
+        drained_bytes += bytes;
+    }
+
+    // Called regularly with the number of bytes queued. Returns the new
+    // bound, or -1 if disabled.
+    ssize_t update(const size_t queued, const clock::time_point& now)
+    {
+        std::unique_lock<std::mutex> lock(m);
+
+        if (target <= 0us)
+        {
+            return -1;
+        }
+
+        // Too short an interval makes the samples noisy
+        auto elapsed = now - last_update;
+        if (elapsed < 10ms)
+        {
+            return hwm;
+        }
+
+        size_t bytes = drained_bytes.exchange(0);
+        double seconds = std::chrono::duration<double>(elapsed).count();
+        last_update = now;
+
+        if (backlogged || (queued > 0))
+        {
+            double sample = bytes / seconds;
+            rate = (rate < 0) ? sample : alpha * sample + (1 - alpha) * rate;
+            double bound = rate * std::chrono::duration<double>(target).count();
+            hwm = static_cast<ssize_t>(std::min(std::max(bound, double(min_bytes)),
+                                                double(max_bytes)));
+        }
+        else
+        {
+            hwm = std::min(hwm * 2, static_cast<ssize_t>(max_bytes));
+        }
+
+        backlogged = queued > 0;
+        return hwm;
+    }
+
+    ssize_t get_hwm()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        return (target > 0us) ? hwm : -1;
+    }
+
+    // Bytes per second, or -1 if not measured yet
+    double get_rate()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        return rate;
+    }
+
+private:
+    void reset_locked()
+    {
+        hwm = max_bytes;
+        rate = -1;
+        backlogged = false;
+        drained_bytes = 0;
+        last_update = clock::now();
+    }
+
+    static constexpr double alpha = 0.25;
+
+    std::mutex m;
+    std::chrono::microseconds target = 0us;
+    size_t min_bytes = 1;
+    size_t max_bytes = 1;
+    ssize_t hwm = 1;
+    double rate = -1;
+    bool backlogged = false;
+    std::atomic<size_t> drained_bytes{0};
+    clock::time_point last_update;
+};
@@ -0,0 +1,294 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <openssl/evp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CMAC_AESNI
+#endif
+
+// AES-128-CMAC (RFC 4493) over many messages at once.
+//
+// CMAC chains blocks within a message but messages are independent, so
+// messages are processed in lockstep: each step encrypts the next block of
+// every message together, letting the cipher pipeline them. Messages needn't
+// share a key. With AES-NI, blocks are interleaved whatever their keys, each
+// using its own key's round keys. Otherwise the block cipher comes from
+// OpenSSL, which is called once a step for each key.
+class Cmac
+{
+public:
+    static const size_t BLOCK_SIZE = 16;
+    typedef uint8_t Block[BLOCK_SIZE];
+
+    struct Message
+    {
+        const Cmac *key;
+        const uint8_t *data;
+        size_t len;
+        Block mac;
+    };
+
+    Cmac() :
+        ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free)
+    {
+    }
+
+    bool set_key(const uint8_t (&key)[BLOCK_SIZE])
+    {
+        if (!ctx ||
+            (EVP_EncryptInit_ex(ctx.get(), EVP_aes_128_ecb(), nullptr, key, nullptr) != 1) ||
+            (EVP_CIPHER_CTX_set_padding(ctx.get(), 0) != 1))
+        {
+            return false;
+        }
+
+#ifdef CMAC_AESNI
+        if (has_aesni())
+        {
+            expand_key(key, round_keys);
+        }
+#endif
+
+        Block zero = {0}, l;
+        if (!encrypt(zero, l, 1))
+        {
+            return false;
+        }
+        subkey(l, k1);
+        subkey(k1, k2);
+        return true;
+    }
+
+    // Computes the MAC of each message with its key
+    static bool compute(std::vector<Message*>& msgs)
+    {
+        // Without AES-NI, blocks with the same key need to be next to each
+        // other so they can be encrypted in one call
+        std::stable_sort(msgs.begin(), msgs.end(), [](const Message *a,
+                                                      const Message *b)
+        {
+            return a->key < b->key;
+        });
+
+        size_t max_blocks = 0;
+        for (auto msg : msgs)
+        {
+            memset(msg->mac, 0, BLOCK_SIZE);
+            max_blocks = std::max(max_blocks, blocks(*msg));
+        }
+
+        std::vector<uint8_t> in(msgs.size() * BLOCK_SIZE);
+        std::vector<uint8_t> out(in.size());
+        std::vector<Message*> active;
+
+        for (size_t i = 0; i < max_blocks; ++i)
+        {
+            active.clear();
+            for (auto msg : msgs)
+            {
+                if (i < blocks(*msg))
+                {
+                    uint8_t *block = &in[active.size() * BLOCK_SIZE];
+                    msg->key->get_block(*msg, i, block);
+                    for (size_t j = 0; j < BLOCK_SIZE; ++j)
+                    {
+                        block[j] ^= msg->mac[j];
+                    }
+                    active.push_back(msg);
+                }
+            }
+
+            if (!encrypt(active, in.data(), out.data()))
+            {
+                return false;
+            }
+
+            for (size_t k = 0; k < active.size(); ++k)
+            {
+                memcpy(active[k]->mac, &out[k * BLOCK_SIZE], BLOCK_SIZE);
+            }
+        }
+
+        return true;
+    }
+
+private:
+    static size_t blocks(const Message& msg)
+    {
+        return (msg.len == 0) ? 1 : (msg.len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+
+    // The last block is padded if necessary and masked with a subkey
+    void get_block(const Message& msg, const size_t i, uint8_t *block) const
+    {
+        const size_t offset = i * BLOCK_SIZE;
+        size_t n = (msg.len > offset) ? msg.len - offset : 0;
+        if (n > BLOCK_SIZE)
+        {
+            n = BLOCK_SIZE;
+        }
+
+        memcpy(block, &msg.data[offset], n);
+
+        if (i + 1 < blocks(msg))
+        {
+            return;
+        }
+
+        const uint8_t *k = k1;
+        if (n < BLOCK_SIZE)
+        {
+            memset(&block[n], 0, BLOCK_SIZE - n);
+            block[n] = 0x80;
+            k = k2;
+        }
+
+        for (size_t j = 0; j < BLOCK_SIZE; ++j)
+        {
+            block[j] ^= k[j];
+        }
+    }
+
+    static void subkey(const Block& in, Block& out)
+    {
+        for (size_t i = 0; i < BLOCK_SIZE; ++i)
+        {
+            out[i] = (in[i] << 1) | ((i + 1 < BLOCK_SIZE) ? (in[i + 1] >> 7) : 0);
+        }
+        if (in[0] & 0x80)
+        {
+            out[BLOCK_SIZE - 1] ^= 0x87;
+        }
+    }
+
+    bool encrypt(const uint8_t *in, uint8_t *out, const size_t n) const
+    {
+        int outl;
+        return (n == 0) ||
+               (EVP_EncryptUpdate(ctx.get(), out, &outl, in,
+                                  static_cast<int>(n * BLOCK_SIZE)) == 1);
+    }
+
+    // Encrypts the block of each message with the message's key. Messages
+    // with the same key are next to each other.
+    static bool encrypt(const std::vector<Message*>& msgs,
+                        const uint8_t *in,
+                        uint8_t *out)
+    {
+#ifdef CMAC_AESNI
+        if (has_aesni())
+        {
+            encrypt_aesni(msgs, in, out);
+            return true;
+        }
+#endif
+
+        for (size_t i = 0, j; i < msgs.size(); i = j)
+        {
+            for (j = i + 1; (j < msgs.size()) && (msgs[j]->key == msgs[i]->key); ++j)
+            {
+            }
+            if (!msgs[i]->key->encrypt(&in[i * BLOCK_SIZE], &out[i * BLOCK_SIZE], j - i))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+#ifdef CMAC_AESNI
+    static const size_t ROUNDS = 10;
+    static const size_t LANES = 8;
+
+    static bool has_aesni()
+    {
+        static const bool r = __builtin_cpu_supports("aes");
+        return r;
+    }
+
+    __attribute__((target("aes,sse2")))
+    static __m128i expand_step(__m128i key, __m128i assist)
+    {
+        assist = _mm_shuffle_epi32(assist, 0xff);
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        return _mm_xor_si128(key, assist);
+    }
+
+    __attribute__((target("aes,sse2")))
+    static void expand_key(const uint8_t (&key)[BLOCK_SIZE],
+                           Block (&round_keys)[ROUNDS + 1])
+    {
+        __m128i k[ROUNDS + 1];
+        k[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key));
+        // The round constant must be an immediate
+        k[1] = expand_step(k[0], _mm_aeskeygenassist_si128(k[0], 0x01));
+        k[2] = expand_step(k[1], _mm_aeskeygenassist_si128(k[1], 0x02));
+        k[3] = expand_step(k[2], _mm_aeskeygenassist_si128(k[2], 0x04));
+        k[4] = expand_step(k[3], _mm_aeskeygenassist_si128(k[3], 0x08));
+        k[5] = expand_step(k[4], _mm_aeskeygenassist_si128(k[4], 0x10));
+        k[6] = expand_step(k[5], _mm_aeskeygenassist_si128(k[5], 0x20));
+        k[7] = expand_step(k[6], _mm_aeskeygenassist_si128(k[6], 0x40));
+        k[8] = expand_step(k[7], _mm_aeskeygenassist_si128(k[7], 0x80));
+        k[9] = expand_step(k[8], _mm_aeskeygenassist_si128(k[8], 0x1b));
+        k[10] = expand_step(k[9], _mm_aeskeygenassist_si128(k[9], 0x36));
+        for (size_t i = 0; i <= ROUNDS; ++i)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(round_keys[i]), k[i]);
+        }
+    }
+
+    // Up to LANES blocks are in flight at once, each round interleaved
+    // across them so the AES unit's latency is hidden
+    __attribute__((target("aes,sse2")))
+    static void encrypt_aesni(const std::vector<Message*>& msgs,
+                              const uint8_t *in,
+                              uint8_t *out)
+    {
+        for (size_t base = 0; base < msgs.size(); base += LANES)
+        {
+            const size_t left = msgs.size() - base;
+            const size_t n = (left < LANES) ? left : LANES;
+            __m128i b[LANES];
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                b[i] = _mm_xor_si128(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(&in[(base + i) * BLOCK_SIZE])),
+                    round_key(*msgs[base + i], 0));
+            }
+
+            for (size_t r = 1; r < ROUNDS; ++r)
+            {
+                for (size_t i = 0; i < n; ++i)
+                {
+                    b[i] = _mm_aesenc_si128(b[i], round_key(*msgs[base + i], r));
+                }
+            }
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                b[i] = _mm_aesenclast_si128(b[i], round_key(*msgs[base + i], ROUNDS));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&out[(base + i) * BLOCK_SIZE]), b[i]);
+            }
+        }
+    }
+
+    __attribute__((target("sse2")))
+    static __m128i round_key(const Message& msg, const size_t r)
+    {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(msg.key->round_keys[r]));
+    }
+
+    Block round_keys[ROUNDS + 1];
+#endif
+
+    std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> ctx;
+    Block k1, k2;
+};
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <chrono>
+#include <vector>
+
+// Fixed-size open-addressing table of recently seen frames, keyed by a hash
+// of the PHYPayload (MIC included). An entry only counts as a duplicate
+// within window of the first time its frame was seen. Probing is bounded so
+// lookups stay O(1); when every slot in the probe sequence is live, the
+// oldest one is evicted.
+class DedupTable
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    struct Entry
+    {
+        uint64_t hash = 0;
+        clock::time_point first_seen;
+        bool used = false;
+    };
+
+    // Entries already in the table are moved into the resized one, newest
+    // first, so a live change doesn't forget frames. Live ones which no
+    // longer fit count as evictions.
+    void configure(const size_t capacity,
+                   const std::chrono::microseconds &window)
+    {
+        size_t n = (capacity > 0) ? 1 : 0;
+        while (n < capacity)
+        {
+            n <<= 1;
+        }
+
+        std::vector<Entry> old(n);
+        std::swap(old, entries);
+        this->window = window;
+
+        old.erase(std::remove_if(old.begin(), old.end(), [](const Entry &e)
+        {
+            return !e.used;
+        }), old.end());
+        std::sort(old.begin(), old.end(), [](const Entry &a, const Entry &b)
+        {
+            return a.first_seen > b.first_seen;
+        });
+
+        const auto now = clock::now();
+        for (auto &e : old)
+        {
+            if (!place(e) && ((now - e.first_seen) <= window))
+            {
+                ++evictions;
+            }
+        }
+    }
+
+    void clear()
+    {
+        entries.assign(entries.size(), Entry());
+        evictions = 0;
+    }
+
+    size_t capacity() const
+    {
+        return entries.size();
+    }
+
+    uint64_t get_evictions() const
+    {
+        return evictions;
+    }
+
+    // Records a frame. duplicate is set if it was already seen within the
+    // window. Returns nullptr if the table has no capacity.
+    Entry *insert(const uint64_t hash, const clock::time_point &now,
+                  bool &duplicate)
+    {
+        const size_t mask = entries.size() - 1;
+        Entry *slot = nullptr;
+        bool slot_live = false;
+
+        duplicate = false;
+
+        if (entries.empty())
+        {
+            return nullptr;
+        }
+
+        for (size_t i = 0; i < probes(); ++i)
+        {
+            Entry &e = entries[(hash + i) & mask];
+            bool live = e.used && ((now - e.first_seen) <= window);
+
+            if (live && (e.hash == hash))
+            {
+                duplicate = true;
+                slot = &e;
+                break;
+            }
+
+            if (!live)
+            {
+                if (!slot || slot_live)
+                {
+                    slot = &e;
+                    slot_live = false;
+                }
+            }
+            else if (!slot || (slot_live && (e.first_seen < slot->first_seen)))
+            {
+                slot = &e;
+                slot_live = true;
+            }
+        }
+
+        if (!duplicate)
+        {
+            if (slot_live)
+            {
+                ++evictions;
+            }
+            *slot = Entry();
+            slot->hash = hash;
+            slot->first_seen = now;
+            slot->used = true;
+        }
+
+        return slot;
+    }
+
+    // 64-bit FNV-1a
+    static uint64_t hash(const uint8_t *data, const size_t len)
+    {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < len; ++i)
+        {
+            h ^= data[i];
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+private:
+    // Puts an entry in the first free slot of its probe sequence
+    bool place(const Entry &entry)
+    {
+        const size_t mask = entries.size() - 1;
+
+        for (size_t i = 0; i < probes(); ++i)
+        {
+            Entry &e = entries[(entry.hash + i) & mask];
+            if (!e.used)
+            {
+                e = entry;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    size_t probes() const
+    {
+        return (entries.size() < 8) ? entries.size() : 8;
+    }
+
+    std::vector<Entry> entries;
+    std::chrono::microseconds window = std::chrono::microseconds::zero();
+    uint64_t evictions = 0;
+};
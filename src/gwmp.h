@@ -0,0 +1,436 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Helpers for the Semtech gateway message protocol (GWMP) carried over the
+// links. The packet format is described in sections 3-6 of PROTOCOL.TXT in
+// packet_forwarder_shared.
+namespace gwmp
+{
+
+const uint8_t PROTOCOL_VERSION = 2;
+const uint8_t PUSH_DATA = 0;
+const uint8_t PUSH_ACK = 1;
+const uint8_t PULL_DATA = 2;
+const uint8_t PULL_RESP = 3;
+const uint8_t PULL_ACK = 4;
+const uint8_t TX_ACK = 5;
+
+const size_t ACK_SIZE = 4;
+const size_t EUI_SIZE = 8;
+const size_t PUSH_DATA_HEADER_SIZE = ACK_SIZE + EUI_SIZE;
+
+inline bool is_push_data(const uint8_t *buf, size_t len)
+{
+    return (len >= PUSH_DATA_HEADER_SIZE) &&
+           (buf[0] == PROTOCOL_VERSION) &&
+           (buf[3] == PUSH_DATA);
+}
+
+inline bool is_push_ack(const uint8_t *buf, size_t len)
+{
+    return (len == ACK_SIZE) &&
+           (buf[0] == PROTOCOL_VERSION) &&
+           (buf[3] == PUSH_ACK);
+}
+
+// Just enough JSON scanning to split PUSH_DATA payloads into their rxpk
+// objects and to read or rewrite individual members. Nothing is unescaped;
+// values are handled as raw text.
+namespace json
+{
+
+struct Span
+{
+    size_t start = 0;
+    size_t end = 0;
+};
+
+inline size_t skip_ws(const std::string &s, size_t i)
+{
+    while ((i < s.size()) &&
+           ((s[i] == ' ') || (s[i] == '\t') || (s[i] == '\r') || (s[i] == '\n')))
+    {
+        ++i;
+    }
+    return i;
+}
+
+inline bool skip_string(const std::string &s, size_t &i)
+{
+    if ((i >= s.size()) || (s[i] != '"'))
+    {
+        return false;
+    }
+    for (++i; i < s.size(); ++i)
+    {
+        if (s[i] == '\\')
+        {
+            ++i;
+        }
+        else if (s[i] == '"')
+        {
+            ++i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool skip_value(const std::string &s, size_t &i);
+
+// Calls f(key, value) for each member of the object starting at i.
+template<class F>
+bool members(const std::string &s, size_t i, F f)
+{
+    i = skip_ws(s, i);
+    if ((i >= s.size()) || (s[i] != '{'))
+    {
+        return false;
+    }
+    i = skip_ws(s, i + 1);
+    if ((i < s.size()) && (s[i] == '}'))
+    {
+        return true;
+    }
+    while (true)
+    {
+        Span key, value;
+        key.start = i + 1;
+        if (!skip_string(s, i))
+        {
+            return false;
+        }
+        key.end = i - 1;
+        i = skip_ws(s, i);
+        if ((i >= s.size()) || (s[i] != ':'))
+        {
+            return false;
+        }
+        value.start = i = skip_ws(s, i + 1);
+        if (!skip_value(s, i))
+        {
+            return false;
+        }
+        value.end = i;
+        f(key, value);
+        i = skip_ws(s, i);
+        if (i >= s.size())
+        {
+            return false;
+        }
+        if (s[i] == '}')
+        {
+            return true;
+        }
+        if (s[i] != ',')
+        {
+            return false;
+        }
+        i = skip_ws(s, i + 1);
+    }
+}
+
+// Calls f(element) for each element of the array starting at i.
+template<class F>
+bool elements(const std::string &s, size_t i, F f)
+{
+    i = skip_ws(s, i);
+    if ((i >= s.size()) || (s[i] != '['))
+    {
+        return false;
+    }
+    i = skip_ws(s, i + 1);
+    if ((i < s.size()) && (s[i] == ']'))
+    {
+        return true;
+    }
+    while (true)
+    {
+        Span element;
+        element.start = i;
+        if (!skip_value(s, i))
+        {
+            return false;
+        }
+        element.end = i;
+        f(element);
+        i = skip_ws(s, i);
+        if (i >= s.size())
+        {
+            return false;
+        }
+        if (s[i] == ']')
+        {
+            return true;
+        }
+        if (s[i] != ',')
+        {
+            return false;
+        }
+        i = skip_ws(s, i + 1);
+    }
+}
+
+inline bool skip_value(const std::string &s, size_t &i)
+{
+    if (i >= s.size())
+    {
+        return false;
+    }
+
+    switch (s[i])
+    {
+    case '"':
+        return skip_string(s, i);
+
+    case '{':
+    case '[':
+    {
+        char open = s[i], close = (open == '{') ? '}' : ']';
+        size_t depth = 0;
+        for (; i < s.size(); ++i)
+        {
+            if (s[i] == '"')
+            {
+                if (!skip_string(s, i))
+                {
+                    return false;
+                }
+                --i;
+            }
+            else if (s[i] == open)
+            {
+                ++depth;
+            }
+            else if ((s[i] == close) && (--depth == 0))
+            {
+                ++i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    default:
+    {
+        size_t start = i;
+        while ((i < s.size()) &&
+               (s[i] != ',') && (s[i] != '}') && (s[i] != ']') &&
+               (s[i] != ' ') && (s[i] != '\t') &&
+               (s[i] != '\r') && (s[i] != '\n'))
+        {
+            ++i;
+        }
+        return i > start;
+    }
+    }
+}
+
+inline bool key_equals(const std::string &s, const Span &key, const char *name)
+{
+    return s.compare(key.start, key.end - key.start, name) == 0;
+}
+
+inline bool find(const std::string &obj, const char *name, Span &value)
+{
+    bool found = false;
+    members(obj, 0, [&](const Span &k, const Span &v)
+    {
+        if (!found && key_equals(obj, k, name))
+        {
+            value = v;
+            found = true;
+        }
+    });
+    return found;
+}
+
+inline bool get_number(const std::string &obj, const char *name, double &n)
+{
+    Span v;
+    if (!find(obj, name, v))
+    {
+        return false;
+    }
+    std::string text = obj.substr(v.start, v.end - v.start);
+    char *end;
+    n = strtod(text.c_str(), &end);
+    return (end != text.c_str()) && (*end == '\0');
+}
+
+// Returns the raw (still escaped) contents of a string member.
+inline bool get_string(const std::string &obj, const char *name, std::string &str)
+{
+    Span v;
+    if (!find(obj, name, v) || ((v.end - v.start) < 2) || (obj[v.start] != '"'))
+    {
+        return false;
+    }
+    str = obj.substr(v.start + 1, v.end - v.start - 2);
+    return true;
+}
+
+// Replaces the value of a member, adding it if it doesn't exist.
+// value must already be valid JSON text.
+inline void set(std::string &obj, const char *name, const std::string &value)
+{
+    Span v;
+    if (find(obj, name, v))
+    {
+        obj.replace(v.start, v.end - v.start, value);
+        return;
+    }
+    size_t close = obj.rfind('}');
+    if (close == std::string::npos)
+    {
+        return;
+    }
+    bool empty = obj.find_first_not_of(" \t\r\n", obj.find('{') + 1) == close;
+    obj.insert(close, (empty ? "\"" : ",\"") + std::string(name) + "\":" + value);
+}
+
+} // namespace json
+
+inline bool base64_decode(const std::string &in, std::vector<uint8_t> &out)
+{
+    out.clear();
+    out.reserve(in.size() * 3 / 4);
+    uint32_t acc = 0;
+    int bits = 0;
+    for (char c : in)
+    {
+        int v;
+        if ((c >= 'A') && (c <= 'Z'))
+        {
+            v = c - 'A';
+        }
+        else if ((c >= 'a') && (c <= 'z'))
+        {
+            v = c - 'a' + 26;
+        }
+        else if ((c >= '0') && (c <= '9'))
+        {
+            v = c - '0' + 52;
+        }
+        else if (c == '+')
+        {
+            v = 62;
+        }
+        else if (c == '/')
+        {
+            v = 63;
+        }
+        else if (c == '=')
+        {
+            break;
+        }
+        else
+        {
+            return false;
+        }
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            out.push_back(static_cast<uint8_t>(acc >> bits));
+        }
+    }
+    return true;
+}
+
+// Decodes the PHYPayload in an rxpk object.
+inline bool get_data(const std::string &rxpk, std::vector<uint8_t> &phy)
+{
+    std::string data;
+    return json::get_string(rxpk, "data", data) && base64_decode(data, phy);
+}
+
+// A PUSH_DATA datagram split into its header, rxpk objects and any other
+// top-level members (e.g. stat) so rxpk entries can be removed or rewritten.
+struct PushData
+{
+    uint8_t header[PUSH_DATA_HEADER_SIZE];
+    std::vector<std::string> rxpk;
+    std::string others;
+
+    bool parse(const uint8_t *buf, size_t len)
+    {
+        if (!is_push_data(buf, len))
+        {
+            return false;
+        }
+
+        std::copy(buf, &buf[PUSH_DATA_HEADER_SIZE], header);
+        rxpk.clear();
+        others.clear();
+
+        std::string s(reinterpret_cast<const char*>(&buf[PUSH_DATA_HEADER_SIZE]),
+                      len - PUSH_DATA_HEADER_SIZE);
+        bool ok = true;
+
+        if (!json::members(s, 0, [&](const json::Span &k, const json::Span &v)
+            {
+                if (json::key_equals(s, k, "rxpk"))
+                {
+                    ok = ok && json::elements(s, v.start, [&](const json::Span &e)
+                    {
+                        rxpk.push_back(s.substr(e.start, e.end - e.start));
+                    });
+                }
+                else
+                {
+                    if (!others.empty())
+                    {
+                        others += ',';
+                    }
+                    others += s.substr(k.start - 1, v.end - k.start + 1);
+                }
+            }))
+        {
+            return false;
+        }
+
+        return ok;
+    }
+
+    bool empty() const
+    {
+        return rxpk.empty() && others.empty();
+    }
+
+    std::vector<uint8_t> serialize() const
+    {
+        std::string s = "{";
+        if (!rxpk.empty())
+        {
+            s += "\"rxpk\":[";
+            for (size_t i = 0; i < rxpk.size(); ++i)
+            {
+                if (i > 0)
+                {
+                    s += ',';
+                }
+                s += rxpk[i];
+            }
+            s += ']';
+            if (!others.empty())
+            {
+                s += ',';
+            }
+        }
+        s += others;
+        s += '}';
+
+        std::vector<uint8_t> r(header, &header[PUSH_DATA_HEADER_SIZE]);
+        r.insert(r.end(), s.begin(), s.end());
+        return r;
+    }
+};
+
+} // namespace gwmp
@@ -0,0 +1,855 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <lora_comms_int.h>
+#include "adaptive_hwm.h"
+#include "gwmp.h"
+#include "dedup.h"
+#include "lorawan.h"
+#include "packet_queue.h"
+#include "packet_ring.h"
+#include "thread_options.h"
+#include "uplink_record.h"
+
+using namespace std::chrono_literals;
+
+inline BudgetAccount link_account(const enum comm_link link)
+{
+    return (link == uplink) ? budget_uplink : budget_downlink;
+}
+
+enum PhyMode
+{
+    phy_off,
+    phy_mark,   // add decoded fields and MIC status to each rxpk
+    phy_drop    // also drop frames which aren't authenticated
+};
+
+enum UplinkFormat
+{
+    format_gwmp,
+    format_binary   // a fixed-layout record per frame (see uplink_record.h)
+};
+
+struct PhyStats
+{
+    uint64_t frames = 0;
+    uint64_t ok = 0;
+    uint64_t failed = 0;
+    uint64_t unknown = 0;
+    uint64_t invalid = 0;
+    uint64_t dropped = 0;
+};
+
+struct FormatStats
+{
+    uint64_t records = 0;
+    uint64_t invalid = 0;
+};
+
+struct AdaptiveStats
+{
+    ssize_t hwm = -1;
+    double drain_rate = -1;
+    uint64_t dropped = 0;
+};
+
+struct DedupStats
+{
+    uint64_t frames = 0;
+    uint64_t duplicates = 0;
+    uint64_t evictions = 0;
+    uint64_t held = 0;
+};
+
+// Reads packets from a link on a native thread so they can be processed
+// before JavaScript sees them. Only used when a processing stage or
+// broadcast is enabled; otherwise recv_from() goes straight to the shared
+// library.
+//
+// Packets are delivered to the queue read by recv_from() and, if broadcast
+// is enabled, published to a ring which any number of subscribers can read.
+// The queue then holds at most as many packets as the ring, so it doesn't
+// grow without bound when only subscribers are reading.
+// They're charged to the link's memory budget account and dropped if the
+// budget doesn't allow them. With an adaptive high-water mark, they're also
+// dropped if the queue already holds more than the application can read
+// within the target latency. The link's send high-water mark and timeout
+// apply to the queue too, as they would to the forwarder's.
+//
+// Uplink PHYPayloads can be decoded, adding their header fields to each rxpk
+// object as "phy". MICs of data frames are verified using the session keys
+// registered with the verifier. In drop mode, data frames which fail, have
+// no session or can't be decoded are removed. This happens before
+// deduplication so forged frames can't suppress genuine ones.
+//
+// Uplink deduplication drops rxpk objects whose PHYPayload was already
+// received within the window. In merge mode, the first copy of each frame is
+// held until its window expires and then delivered in a new PUSH_DATA with
+// the best rssi and lsnr of all copies and the number of copies in rcnt.
+// Held and fully suppressed PUSH_DATA packets are acknowledged natively.
+// Frames still held when the link closes are delivered straight away.
+//
+// In binary format, each uplink frame is delivered as a separate record
+// rather than as JSON inside a PUSH_DATA. PUSH_DATA packets are acknowledged
+// natively unless they have other members (e.g. stat), which are delivered
+// as a PUSH_DATA without rxpk for the application to acknowledge as usual.
+class LinkReader
+{
+public:
+    LinkReader(const enum comm_link link) :
+        link(link),
+        account(link_account(link))
+    {
+        std::fill(std::begin(native_tokens), std::end(native_tokens), -1);
+        std::fill(std::begin(forwarder_tokens), std::end(forwarder_tokens), -1);
+        memory_budget().set_shedder(account, [this](size_t bytes)
+        {
+            return output.shed(bytes);
+        });
+    }
+
+    ~LinkReader()
+    {
+        stop();
+    }
+
+    void set_dedup(const size_t capacity,
+                   const std::chrono::microseconds &window,
+                   const bool merge)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        dedup.configure(capacity, window);
+        dedup_window = window;
+        dedup_merge = merge;
+        // Frames already held are still delivered. They keep their merged
+        // metadata unless the table no longer has room for their entries.
+    }
+
+    DedupStats get_dedup_stats()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        DedupStats r = dedup_stats;
+        r.evictions = dedup.get_evictions();
+        r.held = held.size();
+        return r;
+    }
+
+    void set_phy(const PhyMode mode)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        phy_mode = mode;
+    }
+
+    void set_format(const UplinkFormat format)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        this->format = format;
+    }
+
+    PhyStats get_phy_stats()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        return phy_stats;
+    }
+
+    FormatStats get_format_stats()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        return format_stats;
+    }
+
+    lorawan::MicVerifier& get_verifier()
+    {
+        return verifier;
+    }
+
+    void set_watermarks(const Watermarks& watermarks,
+                        const WatermarkCallback& callback)
+    {
+        output.set_watermarks(watermarks, callback);
+    }
+
+    QueueStats get_queue_stats()
+    {
+        return output.get_stats();
+    }
+
+    void set_adaptive_hwm(const std::chrono::microseconds& target,
+                          const size_t min_bytes,
+                          const size_t max_bytes)
+    {
+        adaptive.configure(target, min_bytes, max_bytes);
+    }
+
+    AdaptiveStats get_adaptive_stats()
+    {
+        AdaptiveStats r;
+        r.hwm = adaptive.get_hwm();
+        r.drain_rate = adaptive.get_rate();
+        r.dropped = output_dropped;
+        return r;
+    }
+
+    // Limits on the queue the application reads from, with the same meaning
+    // as the forwarder's send high-water mark and timeout. They can change
+    // at any time, unlike the forwarder's, which its own threads read.
+    void set_send_hwm(const ssize_t hwm)
+    {
+        send_hwm = hwm;
+    }
+
+    void set_send_timeout(const std::chrono::microseconds& timeout)
+    {
+        send_timeout = timeout.count();
+    }
+
+    void set_broadcast(const size_t capacity)
+    {
+        ring.configure(capacity);
+    }
+
+    std::shared_ptr<PacketRing::Subscription> subscribe(
+        const SlowConsumerPolicy policy,
+        const std::function<void()>& notify)
+    {
+        return ring.subscribe(policy, notify);
+    }
+
+    void unsubscribe(const std::shared_ptr<PacketRing::Subscription>& sub)
+    {
+        ring.unsubscribe(sub);
+    }
+
+    int recv(PacketRing::Subscription& sub, Packet& pkt)
+    {
+        return ring.recv(sub, pkt);
+    }
+
+    SubscriptionStats get_subscription_stats(const PacketRing::Subscription& sub)
+    {
+        return ring.stats(sub);
+    }
+
+    void set_thread_options(const ThreadOptions& options)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        thread_options = options;
+    }
+
+    ThreadSettings get_thread_settings()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        return thread_settings;
+    }
+
+    // Called on the main thread before the forwarder starts, so reads issued
+    // by JavaScript straight afterwards go to the right place.
+    void prepare()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        active = (dedup.capacity() > 0) ||
+                 (phy_mode != phy_off) ||
+                 (format != format_gwmp) ||
+                 (ring.capacity() > 0) ||
+                 output.has_watermarks() ||
+                 adaptive.enabled() ||
+                 (memory_budget().get_budget() > 0);
+    }
+
+    bool is_active() const
+    {
+        return active;
+    }
+
+    void start()
+    {
+        if (!active)
+        {
+            return;
+        }
+
+        stop_requested = false;
+        {
+            std::unique_lock<std::mutex> lock(m);
+            thread_settings = ThreadSettings();
+        }
+        thread = std::thread(&LinkReader::run, this);
+    }
+
+    void stop()
+    {
+        if (!thread.joinable())
+        {
+            return;
+        }
+
+        stop_requested = true;
+        // don't leave the thread waiting for a slow subscriber
+        ring.close();
+        thread.join();
+    }
+
+    void reset()
+    {
+        // discard anything left unread from the last run
+        output.close();
+        output.reset();
+        ring.reset();
+        adaptive.reset();
+        output_dropped = 0;
+        std::unique_lock<std::mutex> lock(m);
+        dedup.clear();
+        dedup_stats = DedupStats();
+        phy_stats = PhyStats();
+        format_stats = FormatStats();
+        held.clear();
+        held_frames.clear();
+        std::fill(std::begin(native_tokens), std::end(native_tokens), -1);
+        std::fill(std::begin(forwarder_tokens), std::end(forwarder_tokens), -1);
+    }
+
+    ssize_t recv(void *buf, size_t len, const std::chrono::microseconds &timeout)
+    {
+        ssize_t r = output.recv(buf, len, timeout);
+        if (r > 0)
+        {
+            adaptive.drained(r);
+        }
+        return r;
+    }
+
+    // PUSH_DATA packets made up of merged frames didn't come from the
+    // forwarder, so it mustn't see their acknowledgements. PUSH_ACK only
+    // carries the token, so merged packets are never given a token the
+    // forwarder has used recently (see native_token()).
+    bool swallow_ack(const void *buf, size_t len)
+    {
+        auto bytes = static_cast<const uint8_t*>(buf);
+
+        if (!gwmp::is_push_ack(bytes, len))
+        {
+            return false;
+        }
+
+        int token = (bytes[1] << 8) | bytes[2];
+
+        std::unique_lock<std::mutex> lock(m);
+        for (auto &t : native_tokens)
+        {
+            if (t == token)
+            {
+                t = -1;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+private:
+    typedef DedupTable::clock clock;
+
+    // A frame held for merging, with the metadata merged so far. This
+    // doesn't rely on the frame's table entry, which may be evicted first.
+    struct Held
+    {
+        uint64_t hash;
+        clock::time_point deadline;
+        uint8_t eui[gwmp::EUI_SIZE];
+        std::string rxpk;
+        uint32_t count;
+        double rssi;
+        double lsnr;
+    };
+
+    void run()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m);
+            thread_settings = apply_thread_options(thread_options);
+        }
+
+        std::vector<uint8_t> buf(recv_from_buflen);
+
+        while (!stop_requested)
+        {
+            struct timeval tv = poll_timeout();
+            ssize_t n = recv_from(link, buf.data(), buf.size(), &tv);
+            if ((n < 0) && (errno != EAGAIN))
+            {
+                break;
+            }
+            // Sample what the application left queued before adding to it,
+            // otherwise every arrival looks like a backlog and the bound
+            // never relaxes however fast the application reads
+            adaptive.update(output.get_stats().bytes, AdaptiveHwm::clock::now());
+            if (n >= 0)
+            {
+                process(buf.data(), n);
+            }
+            flush();
+        }
+
+        // Frames held for merging won't get any more duplicates, so pass them
+        // on rather than losing them, and let the application read what's
+        // left before the link reports it's closed.
+        flush(true);
+        output.close(false);
+        ring.close();
+    }
+
+    struct timeval poll_timeout()
+    {
+        // Wake up regularly to check whether we've been asked to stop
+        std::chrono::microseconds timeout = poll_interval;
+
+        std::unique_lock<std::mutex> lock(m);
+        if (!held.empty())
+        {
+            timeout = std::max(0us, std::min(timeout,
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    held.front().deadline - clock::now())));
+        }
+
+        struct timeval tv;
+        tv.tv_sec = timeout.count() / 1000000;
+        tv.tv_usec = timeout.count() % 1000000;
+        return tv;
+    }
+
+    void process(const uint8_t *buf, const size_t len)
+    {
+        std::unique_lock<std::mutex> lock(m);
+
+        if ((link == uplink) && gwmp::is_push_data(buf, len))
+        {
+            forwarder_token(buf);
+        }
+
+        gwmp::PushData push_data;
+        if ((link != uplink) ||
+            ((dedup.capacity() == 0) &&
+             (phy_mode == phy_off) &&
+             (format == format_gwmp)) ||
+            !push_data.parse(buf, len))
+        {
+            lock.unlock();
+            deliver(make_packet(account, buf, &buf[len]));
+            return;
+        }
+
+        size_t count = push_data.rxpk.size();
+        bool changed = (phy_mode != phy_off) && decode_phy(push_data.rxpk);
+
+        if (dedup.capacity() > 0)
+        {
+            deduplicate(push_data.rxpk, &buf[gwmp::ACK_SIZE]);
+        }
+
+        std::vector<Packet> records;
+        if (format == format_binary)
+        {
+            records = to_records(push_data.rxpk, &buf[gwmp::ACK_SIZE]);
+            push_data.rxpk.clear();
+        }
+
+        lock.unlock();
+
+        for (auto &record : records)
+        {
+            deliver(record);
+        }
+
+        if (!changed && (push_data.rxpk.size() == count))
+        {
+            deliver(make_packet(account, buf, &buf[len]));
+            return;
+        }
+
+        if (push_data.empty())
+        {
+            // Don't hold up the reader if the forwarder isn't reading
+            uint8_t ack[gwmp::ACK_SIZE] = { buf[0], buf[1], buf[2], gwmp::PUSH_ACK };
+            struct timeval tv = { 0, 0 };
+            send_to(link, ack, sizeof(ack), -1, &tv);
+            return;
+        }
+
+        deliver(make_packet(account, push_data.serialize()));
+    }
+
+    // Annotates rxpk objects with their decoded PHYPayloads and, in drop
+    // mode, removes unauthenticated frames. Returns whether anything changed.
+    bool decode_phy(std::vector<std::string>& rxpk)
+    {
+        std::vector<std::vector<uint8_t>> phys(rxpk.size());
+        std::vector<lorawan::Frame> frames(rxpk.size());
+        std::vector<bool> decoded(rxpk.size());
+
+        for (size_t i = 0; i < rxpk.size(); ++i)
+        {
+            decoded[i] = gwmp::get_data(rxpk[i], phys[i]);
+            if (decoded[i])
+            {
+                frames[i].decode(phys[i].data(), phys[i].size());
+            }
+        }
+
+        verifier.verify(frames);
+
+        bool changed = false;
+        std::vector<std::string> r;
+
+        for (size_t i = 0; i < rxpk.size(); ++i)
+        {
+            if (!decoded[i])
+            {
+                // no data or not base64
+                r.push_back(std::move(rxpk[i]));
+                continue;
+            }
+
+            auto& frame = frames[i];
+            ++phy_stats.frames;
+            switch (frame.mic)
+            {
+            case lorawan::mic_ok:
+                ++phy_stats.ok;
+                break;
+            case lorawan::mic_fail:
+                ++phy_stats.failed;
+                break;
+            case lorawan::mic_unknown:
+                ++phy_stats.unknown;
+                break;
+            case lorawan::mic_invalid:
+                ++phy_stats.invalid;
+                break;
+            default:
+                break;
+            }
+
+            changed = true;
+
+            if ((phy_mode == phy_drop) &&
+                (frame.mic != lorawan::mic_ok) &&
+                (frame.mic != lorawan::mic_none))
+            {
+                ++phy_stats.dropped;
+                continue;
+            }
+
+            gwmp::json::set(rxpk[i], "phy", frame.to_json());
+            r.push_back(std::move(rxpk[i]));
+        }
+
+        rxpk = std::move(r);
+        return changed;
+    }
+
+    // Called with the lock held. Frames without valid data can't be made
+    // into records so are counted and dropped.
+    std::vector<Packet> to_records(const std::vector<std::string>& rxpk,
+                                   const uint8_t *eui)
+    {
+        std::vector<Packet> r;
+        for (auto &obj : rxpk)
+        {
+            uplink_record::Record record;
+            if (record.from_rxpk(obj, eui))
+            {
+                ++format_stats.records;
+                r.push_back(make_packet(account, record.serialize()));
+            }
+            else
+            {
+                ++format_stats.invalid;
+            }
+        }
+        return r;
+    }
+
+    void deduplicate(std::vector<std::string>& objs, const uint8_t *eui)
+    {
+        auto now = clock::now();
+        std::vector<std::string> rxpk;
+
+        for (auto &obj : objs)
+        {
+            std::vector<uint8_t> phy;
+            if (!gwmp::get_data(obj, phy))
+            {
+                rxpk.push_back(obj);
+                continue;
+            }
+
+            double rssi = -INFINITY, lsnr = -INFINITY;
+            gwmp::json::get_number(obj, "rssi", rssi);
+            gwmp::json::get_number(obj, "lsnr", lsnr);
+
+            const uint64_t hash = DedupTable::hash(phy.data(), phy.size());
+            bool duplicate;
+            if (!dedup.insert(hash, now, duplicate))
+            {
+                rxpk.push_back(obj);
+                continue;
+            }
+            ++dedup_stats.frames;
+
+            // A frame still held is a duplicate even if the table has
+            // evicted its entry since
+            auto it = dedup_merge ? held_frames.find(hash) : held_frames.end();
+            if (it != held_frames.end())
+            {
+                ++dedup_stats.duplicates;
+                auto &h = *it->second;
+                ++h.count;
+                h.rssi = std::max(h.rssi, rssi);
+                h.lsnr = std::max(h.lsnr, lsnr);
+            }
+            else if (duplicate)
+            {
+                ++dedup_stats.duplicates;
+            }
+            else if (dedup_merge)
+            {
+                Held h;
+                h.hash = hash;
+                h.deadline = now + dedup_window;
+                std::copy(eui, &eui[gwmp::EUI_SIZE], h.eui);
+                h.rxpk = obj;
+                h.count = 1;
+                h.rssi = rssi;
+                h.lsnr = lsnr;
+                held.push_back(std::move(h));
+                held_frames[hash] = &held.back();
+            }
+            else
+            {
+                rxpk.push_back(obj);
+            }
+        }
+
+        objs = std::move(rxpk);
+    }
+
+    void deliver(const Packet& pkt)
+    {
+        if (!pkt)
+        {
+            // over budget
+            return;
+        }
+        ring.publish(pkt);
+
+        // Subscribers may be the only ones reading the link, so while
+        // broadcasting the queue doesn't hold more than they can lag by
+        if ((ring.capacity() > 0) &&
+            (output.get_stats().packets >= ring.capacity()))
+        {
+            ++output_dropped;
+            return;
+        }
+
+        // The application's high-water mark waits for up to its timeout;
+        // the adaptive one drops straight away
+        ssize_t hwm = send_hwm;
+        std::chrono::microseconds timeout(send_timeout);
+        const ssize_t adaptive_hwm = adaptive.get_hwm();
+        if ((hwm < 0) || ((adaptive_hwm >= 0) && (adaptive_hwm < hwm)))
+        {
+            hwm = adaptive_hwm;
+            timeout = 0us;
+        }
+
+        // Waits a poll interval at a time so stopping isn't held up by an
+        // application which isn't reading
+        while (true)
+        {
+            const auto wait = (timeout < 0us) ? poll_interval :
+                              std::min(timeout, poll_interval);
+            const ssize_t r = output.send(pkt, hwm, wait);
+            if (r > 0)
+            {
+                return;
+            }
+            if ((r < 0) && (errno == EAGAIN) && !stop_requested &&
+                ((timeout < 0us) || ((timeout -= wait) > 0us)))
+            {
+                continue;
+            }
+            if ((r == 0) || (errno == EAGAIN))
+            {
+                ++output_dropped;
+            }
+            return;
+        }
+    }
+
+    // Delivers held frames whose windows have expired (or all of them), with
+    // the metadata merged from their duplicates.
+    void flush(const bool all = false)
+    {
+        std::vector<Packet> pkts;
+
+        {
+            std::unique_lock<std::mutex> lock(m);
+            auto now = clock::now();
+
+            while (!held.empty() && (all || (held.front().deadline <= now)))
+            {
+                if (format == format_binary)
+                {
+                    auto &h = held.front();
+                    merge(h);
+                    auto records = to_records({ h.rxpk }, h.eui);
+                    pkts.insert(pkts.end(), records.begin(), records.end());
+                    pop_held();
+                    continue;
+                }
+
+                gwmp::PushData push_data;
+                uint16_t token = native_token();
+                push_data.header[0] = gwmp::PROTOCOL_VERSION;
+                push_data.header[1] = token >> 8;
+                push_data.header[2] = token & 0xff;
+                push_data.header[3] = gwmp::PUSH_DATA;
+                std::copy(std::begin(held.front().eui),
+                          std::end(held.front().eui),
+                          &push_data.header[gwmp::ACK_SIZE]);
+
+                while (!held.empty() &&
+                       (all || (held.front().deadline <= now)) &&
+                       std::equal(std::begin(held.front().eui),
+                                  std::end(held.front().eui),
+                                  &push_data.header[gwmp::ACK_SIZE]))
+                {
+                    auto &h = held.front();
+                    merge(h);
+                    push_data.rxpk.push_back(std::move(h.rxpk));
+                    pop_held();
+                }
+
+                pkts.push_back(make_packet(account, push_data.serialize()));
+            }
+        }
+
+        for (auto &pkt : pkts)
+        {
+            deliver(pkt);
+        }
+    }
+
+    // Called with the lock held for each PUSH_DATA from the forwarder. If a
+    // merged packet is still waiting for its acknowledgement under the same
+    // token, the acknowledgement can't be told apart, so it's left for the
+    // forwarder, which ignores ones it isn't waiting for.
+    void forwarder_token(const uint8_t *header)
+    {
+        int token = (header[1] << 8) | header[2];
+        forwarder_tokens[next_forwarder_token++ % tokens_size] = token;
+        for (auto &t : native_tokens)
+        {
+            if (t == token)
+            {
+                t = -1;
+            }
+        }
+    }
+
+    // Called with the lock held. Allocates a token for a merged PUSH_DATA,
+    // skipping the forwarder's recent ones so their acknowledgements don't
+    // get swallowed.
+    uint16_t native_token()
+    {
+        uint16_t token;
+        do
+        {
+            token = next_token++;
+        }
+        while (std::find(std::begin(forwarder_tokens),
+                         std::end(forwarder_tokens),
+                         token) != std::end(forwarder_tokens));
+
+        native_tokens[next_native_token++ % tokens_size] = token;
+        return token;
+    }
+
+    void merge(Held &h)
+    {
+        if (std::isfinite(h.rssi))
+        {
+            gwmp::json::set(h.rxpk, "rssi", number(h.rssi));
+        }
+        if (std::isfinite(h.lsnr))
+        {
+            gwmp::json::set(h.rxpk, "lsnr", number(h.lsnr));
+        }
+        gwmp::json::set(h.rxpk, "rcnt", std::to_string(h.count));
+    }
+
+    // Called with the lock held
+    void pop_held()
+    {
+        auto it = held_frames.find(held.front().hash);
+        if ((it != held_frames.end()) && (it->second == &held.front()))
+        {
+            held_frames.erase(it);
+        }
+        held.pop_front();
+    }
+
+    static std::string number(const double n)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%g", n);
+        return buf;
+    }
+
+    static const size_t tokens_size = 32;
+
+    const enum comm_link link;
+    const BudgetAccount account;
+    const std::chrono::microseconds poll_interval = 100ms;
+    std::mutex m;
+    std::thread thread;
+    std::atomic<bool> stop_requested{false};
+    std::atomic<bool> active{false};
+    PacketQueue output;
+    PacketRing ring;
+    AdaptiveHwm adaptive;
+    std::atomic<uint64_t> output_dropped{0};
+    std::atomic<ssize_t> send_hwm{-1};
+    std::atomic<std::chrono::microseconds::rep> send_timeout{-1};
+    ThreadOptions thread_options;
+    ThreadSettings thread_settings;
+
+    UplinkFormat format = format_gwmp;
+    FormatStats format_stats;
+    PhyMode phy_mode = phy_off;
+    PhyStats phy_stats;
+    lorawan::MicVerifier verifier;
+
+    DedupTable dedup;
+    std::chrono::microseconds dedup_window = 0us;
+    bool dedup_merge = false;
+    DedupStats dedup_stats;
+    // Elements of a deque stay put when others are added at the back or
+    // removed from the front, so they can be indexed by pointer
+    std::deque<Held> held;
+    std::unordered_map<uint64_t, Held*> held_frames;
+
+    uint16_t next_token = 0;
+    int native_tokens[tokens_size];
+    size_t next_native_token = 0;
+    int forwarder_tokens[tokens_size];
+    size_t next_forwarder_token = 0;
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include "packet_queue.h"
+
+// Queue of diagnostic messages written by the forwarder's logger. Messages
+// are charged to the memory budget, which may discard the oldest ones to
+// make room for packets.
+class LogQueue : public PacketQueue
+{
+public:
+    LogQueue(const BudgetAccount account) :
+        account(account)
+    {
+        memory_budget().set_shedder(account, [this](size_t bytes)
+        {
+            return shed(bytes);
+        });
+    }
+
+    ssize_t write(const char *format, va_list ap)
+    {
+        size_t max_size = max_msg_size;
+        std::vector<uint8_t> msg(max_size + 1);
+        int n = vsnprintf(reinterpret_cast<char*>(msg.data()), max_size + 1, format, ap);
+        if (n <= 0)
+        {
+            return n;
+        }
+        msg.resize(std::min(static_cast<size_t>(n), max_size));
+
+        auto pkt = make_packet(account, std::move(msg));
+        if (!pkt)
+        {
+            errno = ENOBUFS;
+            return -1;
+        }
+
+        return send(pkt, write_hwm, std::chrono::microseconds(write_timeout));
+    }
+
+    void set_write_hwm(const ssize_t hwm)
+    {
+        write_hwm = hwm;
+    }
+
+    void set_write_timeout(const std::chrono::microseconds& timeout)
+    {
+        write_timeout = timeout.count();
+    }
+
+    void set_max_msg_size(const size_t max_size)
+    {
+        max_msg_size = max_size;
+    }
+
+    size_t get_max_msg_size() const
+    {
+        return max_msg_size;
+    }
+
+private:
+    const BudgetAccount account;
+    std::atomic<ssize_t> write_hwm{-1};
+    std::atomic<std::chrono::microseconds::rep> write_timeout{-1};
+    std::atomic<size_t> max_msg_size{1024};
+};
@@ -2,8 +2,15 @@
 #include <condition_variable>
 #include <queue>
 #include <chrono>
+#include <map>
+#include <thread>
+#include <sys/mman.h>
 #include <napi.h>
 #include <lora_comms_int.h>
+#include "link_reader.h"
+#include "log_queue.h"
+#include "thread_options.h"
+#include "udp_bridge.h"
 
 using namespace std::chrono_literals;
 
@@ -26,6 +33,41 @@ private:
     static void SetGWSendTimeout(const Napi::CallbackInfo& info);
     static void SetGWRecvTimeout(const Napi::CallbackInfo& info);
 
+    static void SetUplinkDedup(const Napi::CallbackInfo& info);
+    static Napi::Value GetUplinkDedupStats(const Napi::CallbackInfo& info);
+
+    static void SetUplinkPhy(const Napi::CallbackInfo& info);
+    static Napi::Value GetUplinkPhyStats(const Napi::CallbackInfo& info);
+    static void SetUplinkFormat(const Napi::CallbackInfo& info);
+    static Napi::Value GetUplinkFormatStats(const Napi::CallbackInfo& info);
+    static void SetSession(const Napi::CallbackInfo& info);
+    static void RemoveSession(const Napi::CallbackInfo& info);
+    static void ClearSessions(const Napi::CallbackInfo& info);
+
+    static void SetBroadcast(const Napi::CallbackInfo& info);
+    static Napi::Value Subscribe(const Napi::CallbackInfo& info);
+    static void Unsubscribe(const Napi::CallbackInfo& info);
+    static Napi::Value ReadSubscription(const Napi::CallbackInfo& info);
+    static Napi::Value GetSubscriptionStats(const Napi::CallbackInfo& info);
+
+    static void SetForwarderThread(const Napi::CallbackInfo& info);
+    static void SetReaderThread(const Napi::CallbackInfo& info);
+    static Napi::Value GetThreadSettings(const Napi::CallbackInfo& info);
+
+    static void SetBridge(const Napi::CallbackInfo& info);
+    static Napi::Value GetBridgeStats(const Napi::CallbackInfo& info);
+
+    static Napi::Value GetStartupLatency(const Napi::CallbackInfo& info);
+    static Napi::Value IsLinkReaderActive(const Napi::CallbackInfo& info);
+
+    static void SetMemoryBudget(const Napi::CallbackInfo& info);
+    static Napi::Value GetMemoryUsage(const Napi::CallbackInfo& info);
+
+    static void SetWatermarkCallback(const Napi::CallbackInfo& info);
+    static void SetWatermarks(const Napi::CallbackInfo& info);
+    static void SetAdaptiveHWM(const Napi::CallbackInfo& info);
+    static Napi::Value GetQueueStats(const Napi::CallbackInfo& info);
+
     static void StartLogging(const Napi::CallbackInfo& info);
     static void StopLogging(const Napi::CallbackInfo& info);
     static void ResetLogging(const Napi::CallbackInfo& info);
@@ -40,6 +82,8 @@ private:
                                   const uint32_t arg);
     static enum comm_link CommLink(const Napi::CallbackInfo& info,
                                    const uint32_t arg);
+    static ThreadOptions ToThreadOptions(const Napi::CallbackInfo& info,
+                                         const uint32_t arg);
 };
 
 // LoRaComms has no instance methods so we never create an instance
@@ -65,36 +109,301 @@ Napi::Error ErrnoError(const Napi::Env& env, const int errnum)
 }
 //LCOV_EXCL_STOP
 
+static LinkReader link_readers[] = { { uplink }, { downlink } };
+
+// The forwarder's log messages are queued in the addon rather than the shared
+// library, which passes each one to the logger set with set_logger(). The
+// library's queues could only be bounded by a high-water mark, whereas these
+// charge each message to the memory budget, can have their oldest messages
+// shed and report stats and watermark events like the link queues.
+static LogQueue log_info(budget_log_info), log_error(budget_log_error);
+
+static int LogToQueues(FILE *stream, const char *format, va_list ap)
+{
+    return (stream == stdout ? log_info : log_error).write(format, ap);
+}
+
+static void CloseLogQueues(const bool immediately)
+{
+    log_info.close(immediately);
+    log_error.close(immediately);
+}
+
+struct SubscriptionEntry
+{
+    enum comm_link link;
+    std::shared_ptr<PacketRing::Subscription> sub;
+    Napi::ThreadSafeFunction notify;
+};
+
+// Only accessed from the main thread
+static std::map<uint32_t, SubscriptionEntry> subscriptions;
+static uint32_t next_subscription_id = 0;
+
+struct ForwarderOptions
+{
+    bool dedicated_thread = false;
+    ThreadOptions thread;
+    bool lock_memory = false;
+};
+
+struct ForwarderStatus
+{
+    ThreadSettings thread;
+    bool memory_locked = false;
+    int memory_lock_error = 0;
+};
+
+// Only accessed from the main thread
+static ForwarderOptions forwarder_options;
+
+// Written by the forwarder's thread
+static std::mutex forwarder_status_mutex;
+static ForwarderStatus forwarder_status;
+
+static UdpBridge bridges[2];
+
+// Time start() was called (written on the main thread before the forwarder
+// starts) and microseconds from then until the forwarder was called and the
+// first packet was read from it, or -1.
+static std::chrono::steady_clock::time_point start_time;
+static std::atomic<int64_t> forwarder_latency{-1}, first_packet_latency{-1};
+
+static void RecordLatency(std::atomic<int64_t>& latency)
+{
+    if (latency != -1)
+    {
+        return;
+    }
+
+    int64_t expected = -1;
+    latency.compare_exchange_strong(expected,
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start_time).count());
+}
+
+static std::chrono::microseconds ToMicroseconds(const struct timeval& tv)
+{
+    return tv.tv_sec * 1s + tv.tv_usec * 1us;
+}
+
+static ssize_t RecvFromLink(const enum comm_link link,
+                            void *buf,
+                            size_t len,
+                            struct timeval *timeout)
+{
+    ssize_t r;
+
+    if ((link >= uplink) && (link <= downlink) &&
+        link_readers[link].is_active())
+    {
+        r = link_readers[link].recv(buf, len, ToMicroseconds(*timeout));
+    }
+    else
+    {
+        r = recv_from(link, buf, len, timeout);
+    }
+
+    if ((r >= 0) && (link >= uplink))
+    {
+        RecordLatency(first_packet_latency);
+    }
+
+    return r;
+}
+
+// High-water marks the application set for packets the forwarder sends.
+// They're applied when the forwarder starts, clamped to the memory budget,
+// rather than whenever the budget changes, since the shared library reads
+// them from the forwarder's threads.
+static ssize_t gw_send_hwms[2] = { -1, -1 };
+
+// Set on the main thread before the forwarder starts and cleared on its
+// thread once it has stopped
+static std::atomic<bool> forwarder_running{false};
+
+// The forwarder's queues are held in the shared library so we can only bound
+// them. At least one packet is let through so a small share of the budget
+// doesn't silently discard everything.
+static ssize_t ClampToBudget(const enum comm_link link, ssize_t hwm)
+{
+    ssize_t limit = memory_budget().limit(link_account(link));
+    if ((limit >= 0) && ((hwm < 0) || (hwm > limit)))
+    {
+        hwm = std::max(limit, ssize_t(1));
+    }
+    return hwm;
+}
+
+static ssize_t SendToLink(const enum comm_link link,
+                          const void *buf,
+                          size_t len,
+                          ssize_t hwm,
+                          struct timeval *timeout)
+{
+    if ((link < uplink) || (link > downlink))
+    {
+        return send_to(link, buf, len, hwm, timeout);
+    }
+
+    if (link_readers[link].swallow_ack(buf, len))
+    {
+        return len;
+    }
+
+    return send_to(link, buf, len, ClampToBudget(link, hwm), timeout);
+}
+
+// Runs the forwarder until it stops, along with the threads which read its
+// links and bridge them to a network server. Returns whether the forwarder
+// exited cleanly.
+//
+// mlockall() and munlockall() apply to the whole process, so unlocking when
+// the forwarder stops also undoes any locking the application did itself.
+static bool RunForwarder(const std::string& cfg_dir,
+                         const ForwarderOptions& options)
+{
+    bool memory_locked = false;
+    if (options.lock_memory)
+    {
+        int err = (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) ? 0 : errno;
+        memory_locked = (err == 0);
+        std::unique_lock<std::mutex> lock(forwarder_status_mutex);
+        forwarder_status.memory_locked = memory_locked;
+        forwarder_status.memory_lock_error = err;
+    }
+
+    for (auto& reader : link_readers)
+    {
+        reader.start();
+    }
+
+    for (auto link : { uplink, downlink })
+    {
+        bridges[link].start(
+            [link](void *buf, size_t len, const std::chrono::microseconds& timeout)
+            {
+                struct timeval tv;
+                tv.tv_sec = timeout.count() / 1000000;
+                tv.tv_usec = timeout.count() % 1000000;
+                return RecvFromLink(link, buf, len, &tv);
+            },
+            [link](const void *buf, size_t len)
+            {
+                // don't hold up the bridge if the forwarder isn't reading
+                struct timeval tv = { 0, 100000 };
+                return SendToLink(link, buf, len, -1, &tv);
+            });
+    }
+
+    if (options.dedicated_thread)
+    {
+        // Applied after starting the other threads so only the forwarder's
+        // own threads inherit this thread's affinity and scheduling policy
+        ThreadSettings settings = apply_thread_options(options.thread);
+        std::unique_lock<std::mutex> lock(forwarder_status_mutex);
+        forwarder_status.thread = settings;
+    }
+
+    RecordLatency(forwarder_latency);
+    int r = start(cfg_dir.empty() ? nullptr : cfg_dir.c_str());
+    forwarder_running = false;
+
+    for (auto& bridge : bridges)
+    {
+        bridge.stop();
+    }
+
+    for (auto& reader : link_readers)
+    {
+        reader.stop();
+    }
+
+    CloseLogQueues(false);
+
+    if (memory_locked)
+    {
+        munlockall();
+        std::unique_lock<std::mutex> lock(forwarder_status_mutex);
+        forwarder_status.memory_locked = false;
+    }
+
+    return r == EXIT_SUCCESS;
+}
+
 class StartAsyncWorker : public Napi::AsyncWorker
 {
 public:
     StartAsyncWorker(const Napi::Function& callback,
-                     const Napi::String& cfg_dir) :
+                     const std::string& cfg_dir,
+                     const ForwarderOptions& options) :
         Napi::AsyncWorker(callback),
-        cfg_dir(cfg_dir.Utf8Value())
+        cfg_dir(cfg_dir),
+        options(options)
     {
     }
 
 protected:
     void Execute() override
     {
-        if (start(cfg_dir.empty() ? nullptr : cfg_dir.c_str()) != EXIT_SUCCESS)
+        if (!RunForwarder(cfg_dir, options))
         {
             SetError("failed");
         }
-
-        close_log_queues(false);
     }
 
 private:
     std::string cfg_dir;
+    ForwarderOptions options;
 };
 
 void LoRaComms::Start(const Napi::CallbackInfo& info)
 {
-    (new StartAsyncWorker(info[1].As<Napi::Function>(),
-                          info[0].As<Napi::String>()))
-        ->Queue();
+    for (auto& reader : link_readers)
+    {
+        reader.prepare();
+    }
+
+    for (auto link : { uplink, downlink })
+    {
+        set_gw_send_hwm(link, ClampToBudget(link, gw_send_hwms[link]));
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(forwarder_status_mutex);
+        forwarder_status = ForwarderStatus();
+    }
+
+    forwarder_running = true;
+    start_time = std::chrono::steady_clock::now();
+    forwarder_latency = -1;
+    first_packet_latency = -1;
+
+    Napi::Function callback = info[1].As<Napi::Function>();
+    std::string cfg_dir = info[0].As<Napi::String>().Utf8Value();
+
+    if (!forwarder_options.dedicated_thread)
+    {
+        (new StartAsyncWorker(callback, cfg_dir, forwarder_options))->Queue();
+        return;
+    }
+
+    // Rather than a threadpool thread, which would be tied up for as long as
+    // the forwarder runs. The callback is called through a thread-safe
+    // function once it stops.
+    Napi::ThreadSafeFunction done = Napi::ThreadSafeFunction::New(
+        info.Env(), callback, "lora_comms_forwarder", 0, 1);
+    ForwarderOptions options = forwarder_options;
+
+    std::thread([cfg_dir, options, done]
+    {
+        bool ok = RunForwarder(cfg_dir, options);
+        done.BlockingCall([ok](Napi::Env env, Napi::Function f)
+        {
+            f.Call({ ok ? env.Null() : Napi::Error::New(env, "failed").Value() });
+        });
+        done.Release();
+    }).detach();
 }
 
 void LoRaComms::Stop(const Napi::CallbackInfo& info)
@@ -105,6 +414,12 @@ void LoRaComms::Stop(const Napi::CallbackInfo& info)
 void LoRaComms::Reset(const Napi::CallbackInfo& info)
 {
     reset();
+    std::fill(std::begin(gw_send_hwms), std::end(gw_send_hwms), -1);
+
+    for (auto& reader : link_readers)
+    {
+        reader.reset();
+    }
 }
 
 class CommsAsyncWorker : public Napi::AsyncWorker
@@ -202,7 +517,15 @@ public:
 protected:
     ssize_t Communicate() override
     {
-        return recv_from(link, buf, len, &timeout);
+        // Packets from bridged links go straight to the network server
+        if ((link >= uplink) && (link <= downlink) &&
+            bridges[link].is_enabled())
+        {
+            errno = EBADF;
+            return -1;
+        }
+
+        return RecvFromLink(link, buf, len, &timeout);
     }
 };
 
@@ -231,7 +554,7 @@ public:
 protected:
     ssize_t Communicate() override
     {
-        return send_to(link, buf, len, hwm, &timeout);
+        return SendToLink(link, buf, len, hwm, &timeout);
     }
 
 private:
@@ -248,15 +571,35 @@ void LoRaComms::SendTo(const Napi::CallbackInfo& info)
         ->Queue();
 }
 
+// The forwarder's threads read its send high-water marks and timeouts, so
+// they're only changed while it isn't running. The link's reader applies
+// them to its own queue straight away.
 void LoRaComms::SetGWSendHWM(const Napi::CallbackInfo& info)
 {
-    set_gw_send_hwm(CommLink(info, 0), info[1].As<Napi::Number>());
+    enum comm_link link = CommLink(info, 0);
+    gw_send_hwms[link] = info[1].As<Napi::Number>().Int64Value();
+    link_readers[link].set_send_hwm(gw_send_hwms[link]);
+    if (!forwarder_running)
+    {
+        set_gw_send_hwm(link, ClampToBudget(link, gw_send_hwms[link]));
+    }
 }
 
 void LoRaComms::SetGWSendTimeout(const Napi::CallbackInfo& info)
 {
+    enum comm_link link = CommLink(info, 0);
     struct timeval tv = TimeVal(info, 1);
-    set_gw_send_timeout(CommLink(info, 0), &tv);
+    link_readers[link].set_send_timeout(ToMicroseconds(tv));
+    if (!forwarder_running)
+    {
+        set_gw_send_timeout(link, &tv);
+    }
+}
+
+Napi::Value LoRaComms::IsLinkReaderActive(const Napi::CallbackInfo& info)
+{
+    return Napi::Boolean::New(info.Env(),
+                              link_readers[CommLink(info, 0)].is_active());
 }
 
 void LoRaComms::SetGWRecvTimeout(const Napi::CallbackInfo& info)
@@ -265,48 +608,573 @@ void LoRaComms::SetGWRecvTimeout(const Napi::CallbackInfo& info)
     set_gw_recv_timeout(CommLink(info, 0), &tv);
 }
 
+void LoRaComms::SetUplinkDedup(const Napi::CallbackInfo& info)
+{
+    link_readers[uplink].set_dedup(
+        static_cast<uint32_t>(info[0].As<Napi::Number>()),
+        ToMicroseconds(TimeVal(info, 1)),
+        info[3].As<Napi::Boolean>());
+}
+
+Napi::Value LoRaComms::GetUplinkDedupStats(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    DedupStats stats = link_readers[uplink].get_dedup_stats();
+    Napi::Object r = Napi::Object::New(env);
+    r.Set("frames", Napi::Number::New(env, stats.frames));
+    r.Set("duplicates", Napi::Number::New(env, stats.duplicates));
+    r.Set("evictions", Napi::Number::New(env, stats.evictions));
+    r.Set("held", Napi::Number::New(env, stats.held));
+    return r;
+}
+
+void LoRaComms::SetUplinkPhy(const Napi::CallbackInfo& info)
+{
+    link_readers[uplink].set_phy(
+        static_cast<PhyMode>(info[0].As<Napi::Number>().Int32Value()));
+}
+
+Napi::Value LoRaComms::GetUplinkPhyStats(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    PhyStats stats = link_readers[uplink].get_phy_stats();
+    Napi::Object r = Napi::Object::New(env);
+    r.Set("frames", Napi::Number::New(env, stats.frames));
+    r.Set("ok", Napi::Number::New(env, stats.ok));
+    r.Set("failed", Napi::Number::New(env, stats.failed));
+    r.Set("unknown", Napi::Number::New(env, stats.unknown));
+    r.Set("invalid", Napi::Number::New(env, stats.invalid));
+    r.Set("dropped", Napi::Number::New(env, stats.dropped));
+    r.Set("sessions", Napi::Number::New(env,
+        link_readers[uplink].get_verifier().size()));
+    return r;
+}
+
+void LoRaComms::SetUplinkFormat(const Napi::CallbackInfo& info)
+{
+    link_readers[uplink].set_format(
+        static_cast<UplinkFormat>(info[0].As<Napi::Number>().Int32Value()));
+}
+
+Napi::Value LoRaComms::GetUplinkFormatStats(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    FormatStats stats = link_readers[uplink].get_format_stats();
+    Napi::Object r = Napi::Object::New(env);
+    r.Set("records", Napi::Number::New(env, stats.records));
+    r.Set("invalid", Napi::Number::New(env, stats.invalid));
+    return r;
+}
+
+// Arguments are the DevAddr, the 16 byte network session key and the last
+// uplink frame counter.
+void LoRaComms::SetSession(const Napi::CallbackInfo& info)
+{
+    Napi::Buffer<uint8_t> key = info[1].As<Napi::Buffer<uint8_t>>();
+    if (key.Length() != lorawan::KEY_SIZE)
+    {
+        ErrnoError(info.Env(), EINVAL).ThrowAsJavaScriptException();
+        return;
+    }
+
+    if (!link_readers[uplink].get_verifier().set_session(
+            info[0].As<Napi::Number>().Uint32Value(),
+            *reinterpret_cast<const uint8_t(*)[lorawan::KEY_SIZE]>(key.Data()),
+            info[2].As<Napi::Number>().Uint32Value()))
+    {
+        ErrnoError(info.Env(), ENOMEM).ThrowAsJavaScriptException();
+    }
+}
+
+void LoRaComms::RemoveSession(const Napi::CallbackInfo& info)
+{
+    link_readers[uplink].get_verifier().remove_session(
+        info[0].As<Napi::Number>().Uint32Value());
+}
+
+void LoRaComms::ClearSessions(const Napi::CallbackInfo& info)
+{
+    link_readers[uplink].get_verifier().clear();
+}
+
+void LoRaComms::SetBroadcast(const Napi::CallbackInfo& info)
+{
+    enum comm_link link = CommLink(info, 0);
+    if ((link < uplink) || (link > downlink))
+    {
+        return;
+    }
+
+    link_readers[link].set_broadcast(
+        static_cast<uint32_t>(info[1].As<Napi::Number>()));
+}
+
+Napi::Value LoRaComms::Subscribe(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+
+    enum comm_link link = CommLink(info, 0);
+    if ((link < uplink) || (link > downlink))
+    {
+        ErrnoError(env, EINVAL).ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    SubscriptionEntry entry;
+    entry.link = link;
+    entry.notify = Napi::ThreadSafeFunction::New(
+        env, info[2].As<Napi::Function>(), "lora_comms_subscription", 0, 1);
+    // Subscriptions alone shouldn't keep the process alive
+    entry.notify.Unref(env);
+
+    Napi::ThreadSafeFunction notify = entry.notify;
+    entry.sub = link_readers[link].subscribe(
+        static_cast<SlowConsumerPolicy>(info[1].As<Napi::Number>().Int32Value()),
+        [notify]
+        {
+            notify.NonBlockingCall();
+        });
+
+    uint32_t id = next_subscription_id++;
+    subscriptions[id] = entry;
+    return Napi::Number::New(env, id);
+}
+
+void LoRaComms::Unsubscribe(const Napi::CallbackInfo& info)
+{
+    auto it = subscriptions.find(info[0].As<Napi::Number>().Uint32Value());
+    if (it == subscriptions.end())
+    {
+        return;
+    }
+
+    link_readers[it->second.link].unsubscribe(it->second.sub);
+    it->second.notify.Release();
+    subscriptions.erase(it);
+}
+
+// Returns the next packet or an error. The packet isn't copied; the Buffer
+// refers to memory shared with other subscribers so mustn't be modified.
+Napi::Value LoRaComms::ReadSubscription(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+
+    auto it = subscriptions.find(info[0].As<Napi::Number>().Uint32Value());
+    if (it == subscriptions.end())
+    {
+        return ErrnoError(env, EBADF).Value();
+    }
+
+    Packet pkt;
+    int err = link_readers[it->second.link].recv(*it->second.sub, pkt);
+    if (err != 0)
+    {
+        return ErrnoError(env, err).Value();
+    }
+
+    if (pkt->empty())
+    {
+        return Napi::Buffer<uint8_t>::New(env, 0);
+    }
+
+    auto holder = new Packet(pkt);
+    return Napi::Buffer<uint8_t>::New(
+        env,
+        const_cast<uint8_t*>((*holder)->data()),
+        (*holder)->size(),
+        [](Napi::Env env, uint8_t *data, Packet *holder)
+        {
+            delete holder;
+        },
+        holder);
+}
+
+Napi::Value LoRaComms::GetSubscriptionStats(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+
+    auto it = subscriptions.find(info[0].As<Napi::Number>().Uint32Value());
+    if (it == subscriptions.end())
+    {
+        return env.Undefined();
+    }
+
+    SubscriptionStats stats =
+        link_readers[it->second.link].get_subscription_stats(*it->second.sub);
+    Napi::Object r = Napi::Object::New(env);
+    r.Set("received", Napi::Number::New(env, stats.received));
+    r.Set("dropped", Napi::Number::New(env, stats.dropped));
+    r.Set("lag", Napi::Number::New(env, stats.lag));
+    r.Set("max_lag", Napi::Number::New(env, stats.max_lag));
+    r.Set("disconnected", Napi::Boolean::New(env, stats.disconnected));
+    return r;
+}
+
+// Arguments are whether to use a dedicated thread, the thread options (see
+// ToThreadOptions) and whether to lock the process's memory.
+void LoRaComms::SetForwarderThread(const Napi::CallbackInfo& info)
+{
+    forwarder_options.dedicated_thread = info[0].As<Napi::Boolean>();
+    forwarder_options.thread = ToThreadOptions(info, 1);
+    forwarder_options.lock_memory = info[4].As<Napi::Boolean>();
+}
+
+void LoRaComms::SetReaderThread(const Napi::CallbackInfo& info)
+{
+    enum comm_link link = CommLink(info, 0);
+    if ((link < uplink) || (link > downlink))
+    {
+        return;
+    }
+
+    link_readers[link].set_thread_options(ToThreadOptions(info, 1));
+}
+
+static Napi::Value FromThreadSettings(const Napi::Env& env,
+                                      const ThreadSettings& settings)
+{
+    if (!settings.applied)
+    {
+        return env.Null();
+    }
+
+    Napi::Array cpus = Napi::Array::New(env, settings.cpus.size());
+    for (uint32_t i = 0; i < settings.cpus.size(); ++i)
+    {
+        cpus.Set(i, Napi::Number::New(env, settings.cpus[i]));
+    }
+
+    Napi::Object r = Napi::Object::New(env);
+    r.Set("cpus", cpus);
+    r.Set("policy", Napi::Number::New(env, settings.policy));
+    r.Set("priority", Napi::Number::New(env, settings.priority));
+    r.Set("affinity_error", settings.affinity_error ?
+        ErrnoError(env, settings.affinity_error).Value() : env.Null());
+    r.Set("sched_error", settings.sched_error ?
+        ErrnoError(env, settings.sched_error).Value() : env.Null());
+    return r;
+}
+
+Napi::Value LoRaComms::GetThreadSettings(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+
+    ForwarderStatus status;
+    {
+        std::unique_lock<std::mutex> lock(forwarder_status_mutex);
+        status = forwarder_status;
+    }
+
+    Napi::Object r = Napi::Object::New(env);
+    r.Set("forwarder", FromThreadSettings(env, status.thread));
+    r.Set("uplink_reader",
+          FromThreadSettings(env, link_readers[uplink].get_thread_settings()));
+    r.Set("downlink_reader",
+          FromThreadSettings(env, link_readers[downlink].get_thread_settings()));
+    r.Set("memory_locked", Napi::Boolean::New(env, status.memory_locked));
+    r.Set("memory_lock_error", status.memory_lock_error ?
+        ErrnoError(env, status.memory_lock_error).Value() : env.Null());
+    return r;
+}
+
+// Arguments are the link, the network server's IP address and port and the
+// maximum number of packets per system call. An empty address disables the
+// bridge.
+void LoRaComms::SetBridge(const Napi::CallbackInfo& info)
+{
+    enum comm_link link = CommLink(info, 0);
+    if ((link < uplink) || (link > downlink))
+    {
+        ErrnoError(info.Env(), EINVAL).ThrowAsJavaScriptException();
+        return;
+    }
+
+    int err = bridges[link].configure(
+        info[1].As<Napi::String>().Utf8Value(),
+        static_cast<uint16_t>(info[2].As<Napi::Number>().Uint32Value()),
+        info[3].As<Napi::Number>().Uint32Value(),
+        std::max(recv_from_buflen, send_to_buflen));
+    if (err != 0)
+    {
+        ErrnoError(info.Env(), err).ThrowAsJavaScriptException();
+    }
+}
+
+Napi::Value LoRaComms::GetBridgeStats(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    enum comm_link link = CommLink(info, 0);
+    if ((link < uplink) || (link > downlink))
+    {
+        return env.Undefined();
+    }
+
+    BridgeStats stats = bridges[link].get_stats();
+    Napi::Object r = Napi::Object::New(env);
+    r.Set("sent", Napi::Number::New(env, stats.sent));
+    r.Set("received", Napi::Number::New(env, stats.received));
+    r.Set("send_batches", Napi::Number::New(env, stats.send_batches));
+    r.Set("recv_batches", Napi::Number::New(env, stats.recv_batches));
+    r.Set("send_errors", Napi::Number::New(env, stats.send_errors));
+    r.Set("recv_errors", Napi::Number::New(env, stats.recv_errors));
+    return r;
+}
+
+Napi::Value LoRaComms::GetStartupLatency(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    Napi::Object r = Napi::Object::New(env);
+    int64_t forwarder = forwarder_latency, first_packet = first_packet_latency;
+    r.Set("forwarder", forwarder < 0 ?
+        env.Null() : Napi::Number::New(env, forwarder));
+    r.Set("first_packet", first_packet < 0 ?
+        env.Null() : Napi::Number::New(env, first_packet));
+    return r;
+}
+
+static BudgetAccount BudgetAccounts[] =
+{
+    budget_uplink, budget_downlink, budget_log_info, budget_log_error
+};
+
+static const char *BudgetAccountNames[] =
+{
+    "uplink", "downlink", "log_info", "log_error"
+};
+
+// Arguments are the budget in bytes, then arrays of each account's share of
+// the budget and priority, in the order of BudgetAccountNames.
+void LoRaComms::SetMemoryBudget(const Napi::CallbackInfo& info)
+{
+    Napi::Array shares_arg = info[1].As<Napi::Array>();
+    Napi::Array priorities_arg = info[2].As<Napi::Array>();
+    double shares[budget_accounts];
+    int priorities[budget_accounts];
+
+    for (auto account : BudgetAccounts)
+    {
+        shares[account] = shares_arg.Get(account).As<Napi::Number>();
+        priorities[account] =
+            priorities_arg.Get(account).As<Napi::Number>().Int32Value();
+    }
+
+    memory_budget().configure(
+        static_cast<size_t>(info[0].As<Napi::Number>().Int64Value()),
+        shares,
+        priorities);
+}
+
+Napi::Value LoRaComms::GetMemoryUsage(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    Napi::Object r = Napi::Object::New(env);
+    r.Set("budget", Napi::Number::New(env, memory_budget().get_budget()));
+    r.Set("used", Napi::Number::New(env, memory_budget().get_used()));
+
+    for (auto account : BudgetAccounts)
+    {
+        BudgetUsage usage = memory_budget().get_usage(account);
+        Napi::Object u = Napi::Object::New(env);
+        u.Set("used", Napi::Number::New(env, usage.used));
+        u.Set("limit", Napi::Number::New(env, usage.limit));
+        u.Set("priority", Napi::Number::New(env, usage.priority));
+        u.Set("dropped", Napi::Number::New(env, usage.dropped));
+        u.Set("shed", Napi::Number::New(env, usage.shed));
+        r.Set(BudgetAccountNames[account], u);
+    }
+
+    return r;
+}
+
+// Set once, when the JavaScript module is loaded
+static Napi::ThreadSafeFunction watermark_notify;
+static std::atomic<bool> watermark_notify_set{false};
+
+struct WatermarkEvent
+{
+    BudgetAccount queue;
+    bool high;
+    size_t packets;
+    size_t bytes;
+};
+
+// The queues call this with their lock held (see WatermarkCallback), which
+// is fine since NonBlockingCall only queues the event for the main thread.
+// Queueing it before the lock is released keeps the events for a queue in the
+// order its state changed.
+static WatermarkCallback WatermarkNotifier(const BudgetAccount queue)
+{
+    return [queue](bool high, size_t packets, size_t bytes)
+    {
+        if (!watermark_notify_set)
+        {
+            return;
+        }
+
+        auto event = new WatermarkEvent { queue, high, packets, bytes };
+        if (watermark_notify.NonBlockingCall(event,
+                [](Napi::Env env, Napi::Function f, WatermarkEvent *event)
+                {
+                    f.Call({ Napi::Number::New(env, event->queue),
+                             Napi::Boolean::New(env, event->high),
+                             Napi::Number::New(env, event->packets),
+                             Napi::Number::New(env, event->bytes) });
+                    delete event;
+                }) != napi_ok)
+        {
+            delete event;
+        }
+    };
+}
+
+void LoRaComms::SetWatermarkCallback(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    if (watermark_notify_set.exchange(false))
+    {
+        watermark_notify.Release();
+    }
+    watermark_notify = Napi::ThreadSafeFunction::New(
+        env, info[0].As<Napi::Function>(), "lora_comms_watermark", 0, 1);
+    // Events alone shouldn't keep the process alive
+    watermark_notify.Unref(env);
+    watermark_notify_set = true;
+}
+
+// Arguments are the queue (in the order of BudgetAccountNames), then the low
+// and high watermarks in packets and in bytes.
+void LoRaComms::SetWatermarks(const Napi::CallbackInfo& info)
+{
+    uint32_t queue = info[0].As<Napi::Number>().Uint32Value();
+    if (queue >= budget_accounts)
+    {
+        ErrnoError(info.Env(), EINVAL).ThrowAsJavaScriptException();
+        return;
+    }
+
+    Watermarks watermarks;
+    watermarks.low_packets = info[1].As<Napi::Number>().Int64Value();
+    watermarks.high_packets = info[2].As<Napi::Number>().Int64Value();
+    watermarks.low_bytes = info[3].As<Napi::Number>().Int64Value();
+    watermarks.high_bytes = info[4].As<Napi::Number>().Int64Value();
+
+    auto callback = WatermarkNotifier(static_cast<BudgetAccount>(queue));
+
+    switch (queue)
+    {
+    case budget_uplink:
+    case budget_downlink:
+        link_readers[queue].set_watermarks(watermarks, callback);
+        break;
+    case budget_log_info:
+        log_info.set_watermarks(watermarks, callback);
+        break;
+    default:
+        log_error.set_watermarks(watermarks, callback);
+        break;
+    }
+}
+
+// Arguments are the link, the target latency (seconds and microseconds) and
+// the minimum and maximum high-water marks in bytes.
+void LoRaComms::SetAdaptiveHWM(const Napi::CallbackInfo& info)
+{
+    enum comm_link link = CommLink(info, 0);
+    if ((link < uplink) || (link > downlink))
+    {
+        return;
+    }
+
+    link_readers[link].set_adaptive_hwm(
+        ToMicroseconds(TimeVal(info, 1)),
+        static_cast<size_t>(info[3].As<Napi::Number>().Int64Value()),
+        static_cast<size_t>(info[4].As<Napi::Number>().Int64Value()));
+}
+
+Napi::Value LoRaComms::GetQueueStats(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    Napi::Object r = Napi::Object::New(env);
+
+    for (auto queue : BudgetAccounts)
+    {
+        QueueStats stats;
+        switch (queue)
+        {
+        case budget_uplink:
+        case budget_downlink:
+            stats = link_readers[queue].get_queue_stats();
+            break;
+        case budget_log_info:
+            stats = log_info.get_stats();
+            break;
+        default:
+            stats = log_error.get_stats();
+            break;
+        }
+
+        Napi::Object s = Napi::Object::New(env);
+        s.Set("packets", Napi::Number::New(env, stats.packets));
+        s.Set("bytes", Napi::Number::New(env, stats.bytes));
+        s.Set("congested", Napi::Boolean::New(env, stats.congested));
+
+        if ((queue == budget_uplink) || (queue == budget_downlink))
+        {
+            AdaptiveStats adaptive = link_readers[queue].get_adaptive_stats();
+            s.Set("hwm", Napi::Number::New(env, adaptive.hwm));
+            s.Set("drain_rate", Napi::Number::New(env, adaptive.drain_rate));
+            s.Set("dropped", Napi::Number::New(env, adaptive.dropped));
+        }
+
+        r.Set(BudgetAccountNames[queue], s);
+    }
+
+    return r;
+}
+
 void LoRaComms::StartLogging(const Napi::CallbackInfo& info)
 {
-    set_logger(log_to_queues);
+    set_logger(LogToQueues);
 }
 
 void LoRaComms::StopLogging(const Napi::CallbackInfo& info)
 {
     set_logger(nullptr);
-    close_log_queues(true);
+    CloseLogQueues(true);
 }
 
 void LoRaComms::ResetLogging(const Napi::CallbackInfo& info)
 {
-    reset_log_queues();
+    log_info.reset();
+    log_error.reset();
 }
 
 class LogAsyncWorker : public CommsAsyncWorker
 {
 public:
     LogAsyncWorker(const Napi::Function& callback,
-                   get_log_message_fn get_log_message, 
+                   LogQueue& log,
                    const Napi::Buffer<uint8_t>& buffer,
                    const struct timeval& timeout) :
         CommsAsyncWorker(callback, buffer, timeout),
-        get_log_message(get_log_message)
+        log(log)
     {
     }
 
 protected:
     ssize_t Communicate() override
     {
-        return get_log_message(static_cast<char*>(buf), len, &timeout);
+        return log.recv(buf, len, ToMicroseconds(timeout));
     }
 
 private:
-    get_log_message_fn get_log_message;
+    LogQueue& log;
 };
 
 void LoRaComms::GetLogInfoMessage(const Napi::CallbackInfo& info)
 {
     (new LogAsyncWorker(info[3].As<Napi::Function>(),
-                        get_log_info_message,
+                        log_info,
                         info[0].As<Napi::Buffer<uint8_t>>(),
                         TimeVal(info, 1)))
         ->Queue();
@@ -315,7 +1183,7 @@ void LoRaComms::GetLogInfoMessage(const Napi::CallbackInfo& info)
 void LoRaComms::GetLogErrorMessage(const Napi::CallbackInfo& info)
 {
     (new LogAsyncWorker(info[3].As<Napi::Function>(),
-                        get_log_error_message,
+                        log_error,
                         info[0].As<Napi::Buffer<uint8_t>>(),
                         TimeVal(info, 1)))
         ->Queue();
@@ -323,23 +1191,30 @@ void LoRaComms::GetLogErrorMessage(const Napi::CallbackInfo& info)
 
 void LoRaComms::SetLogWriteHWM(const Napi::CallbackInfo& info)
 {
-    set_log_write_hwm(info[0].As<Napi::Number>());
+    ssize_t hwm = info[0].As<Napi::Number>().Int64Value();
+    log_info.set_write_hwm(hwm);
+    log_error.set_write_hwm(hwm);
 }
 
 void LoRaComms::SetLogWriteTimeout(const Napi::CallbackInfo& info)
 {
-    struct timeval tv = TimeVal(info, 0);
-    set_log_write_timeout(&tv);
+    auto timeout = ToMicroseconds(TimeVal(info, 0));
+    log_info.set_write_timeout(timeout);
+    log_error.set_write_timeout(timeout);
 }
 
 void LoRaComms::SetLogMaxMessageSize(const Napi::CallbackInfo& info)
 {
-    set_log_max_msg_size(static_cast<uint32_t>(info[0].As<Napi::Number>()));
+    uint32_t max_size = info[0].As<Napi::Number>();
+    log_info.set_max_msg_size(max_size);
+    log_error.set_max_msg_size(max_size);
 }
 
 Napi::Value LoRaComms::GetLogMaxMessageSize(const Napi::CallbackInfo& info)
 {
-    return Napi::Number::New(info.Env(), get_log_max_msg_size());
+    return Napi::Number::New(info.Env(),
+                             std::max(log_info.get_max_msg_size(),
+                                      log_error.get_max_msg_size()));
 }
 
 typedef std::conditional<sizeof(time_t) == 8, int64_t, int32_t>::type tm_t;
@@ -359,6 +1234,21 @@ enum comm_link LoRaComms::CommLink(const Napi::CallbackInfo& info,
     return static_cast<enum comm_link>(info[arg].As<Napi::Number>().Int32Value());
 }
 
+// Arguments are an array of CPUs, the scheduling policy and its priority.
+ThreadOptions LoRaComms::ToThreadOptions(const Napi::CallbackInfo& info,
+                                         const uint32_t arg)
+{
+    ThreadOptions options;
+    Napi::Array cpus = info[arg].As<Napi::Array>();
+    for (uint32_t i = 0; i < cpus.Length(); ++i)
+    {
+        options.cpus.push_back(cpus.Get(i).As<Napi::Number>().Int32Value());
+    }
+    options.policy = info[arg+1].As<Napi::Number>().Int32Value();
+    options.priority = info[arg+2].As<Napi::Number>().Int32Value();
+    return options;
+}
+
 Napi::Object LoRaComms::Initialize(Napi::Env env, Napi::Object exports)
 {
     exports.Set("LoRaComms", DefineClass(env, "LoRaComms",
@@ -377,6 +1267,58 @@ Napi::Object LoRaComms::Initialize(Napi::Env env, Napi::Object exports)
         StaticMethod<&SetGWSendTimeout>("set_gw_send_timeout"),
         StaticMethod<&SetGWRecvTimeout>("set_gw_recv_timeout"),
 
+        StaticMethod<&SetUplinkDedup>("set_uplink_dedup"),
+        StaticMethod<&GetUplinkDedupStats>("get_uplink_dedup_stats"),
+
+        StaticMethod<&SetUplinkPhy>("set_uplink_phy"),
+        StaticMethod<&GetUplinkPhyStats>("get_uplink_phy_stats"),
+        StaticMethod<&SetSession>("set_session"),
+        StaticMethod<&RemoveSession>("remove_session"),
+        StaticMethod<&ClearSessions>("clear_sessions"),
+
+        StaticValue("phy_off", Napi::Number::New(env, phy_off)),
+        StaticValue("phy_mark", Napi::Number::New(env, phy_mark)),
+        StaticValue("phy_drop", Napi::Number::New(env, phy_drop)),
+
+        StaticMethod<&SetUplinkFormat>("set_uplink_format"),
+        StaticMethod<&GetUplinkFormatStats>("get_uplink_format_stats"),
+        StaticValue("format_gwmp", Napi::Number::New(env, format_gwmp)),
+        StaticValue("format_binary", Napi::Number::New(env, format_binary)),
+        StaticValue("record_version", Napi::Number::New(env, uplink_record::RECORD_VERSION)),
+        StaticValue("record_header_size", Napi::Number::New(env, uplink_record::HEADER_SIZE)),
+
+        StaticMethod<&SetBroadcast>("set_broadcast"),
+        StaticMethod<&Subscribe>("subscribe"),
+        StaticMethod<&Unsubscribe>("unsubscribe"),
+        StaticMethod<&ReadSubscription>("read_subscription"),
+        StaticMethod<&GetSubscriptionStats>("get_subscription_stats"),
+
+        StaticValue("policy_block", Napi::Number::New(env, policy_block)),
+        StaticValue("policy_drop", Napi::Number::New(env, policy_drop)),
+        StaticValue("policy_disconnect", Napi::Number::New(env, policy_disconnect)),
+
+        StaticMethod<&SetForwarderThread>("set_forwarder_thread"),
+        StaticMethod<&SetReaderThread>("set_reader_thread"),
+        StaticMethod<&GetThreadSettings>("get_thread_settings"),
+
+        StaticValue("sched_other", Napi::Number::New(env, SCHED_OTHER)),
+        StaticValue("sched_fifo", Napi::Number::New(env, SCHED_FIFO)),
+        StaticValue("sched_rr", Napi::Number::New(env, SCHED_RR)),
+
+        StaticMethod<&SetBridge>("set_bridge"),
+        StaticMethod<&GetBridgeStats>("get_bridge_stats"),
+
+        StaticMethod<&GetStartupLatency>("get_startup_latency"),
+        StaticMethod<&IsLinkReaderActive>("is_link_reader_active"),
+
+        StaticMethod<&SetMemoryBudget>("set_memory_budget"),
+        StaticMethod<&GetMemoryUsage>("get_memory_usage"),
+
+        StaticMethod<&SetWatermarkCallback>("set_watermark_callback"),
+        StaticMethod<&SetWatermarks>("set_watermarks"),
+        StaticMethod<&SetAdaptiveHWM>("set_adaptive_hwm"),
+        StaticMethod<&GetQueueStats>("get_queue_stats"),
+
         StaticMethod<&StartLogging>("start_logging"),
         StaticMethod<&StopLogging>("stop_logging"),
         StaticMethod<&ResetLogging>("reset_logging"),
@@ -390,6 +1332,7 @@ Napi::Object LoRaComms::Initialize(Napi::Env env, Napi::Object exports)
         StaticValue("EBADF", Napi::Number::New(env, EBADF)),
         StaticValue("EAGAIN", Napi::Number::New(env, EAGAIN)),
         StaticValue("EINVAL", Napi::Number::New(env, EINVAL)),
+        StaticValue("ECONNRESET", Napi::Number::New(env, ECONNRESET)),
 
         StaticValue("recv_from_buflen", Napi::Number::New(env, recv_from_buflen)),
         StaticValue("send_to_buflen", Napi::Number::New(env, send_to_buflen))
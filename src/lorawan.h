@@ -0,0 +1,330 @@
+#pragma once
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cmac.h"
+
+namespace lorawan
+{
+
+enum MType
+{
+    JOIN_REQUEST = 0,
+    JOIN_ACCEPT = 1,
+    UNCONFIRMED_DATA_UP = 2,
+    UNCONFIRMED_DATA_DOWN = 3,
+    CONFIRMED_DATA_UP = 4,
+    CONFIRMED_DATA_DOWN = 5,
+    REJOIN_REQUEST = 6,
+    PROPRIETARY = 7
+};
+
+const size_t KEY_SIZE = 16;
+const size_t MIC_SIZE = 4;
+const size_t JOIN_REQUEST_SIZE = 23;
+const size_t DATA_HEADER_SIZE = 8; // MHDR, DevAddr, FCtrl, FCnt
+
+enum MicStatus
+{
+    mic_ok,         // verified with the device's session key
+    mic_fail,       // didn't match
+    mic_unknown,    // no session for the DevAddr
+    mic_none,       // an uplink other than data so not verified here
+    mic_invalid     // couldn't be decoded or not an uplink message
+};
+
+inline const char *mic_status_name(const MicStatus status)
+{
+    static const char *names[] = { "ok", "fail", "unknown", "none", "invalid" };
+    return names[status];
+}
+
+inline uint32_t get_le(const uint8_t *p, const size_t n)
+{
+    uint32_t r = 0;
+    for (size_t i = n; i > 0; --i)
+    {
+        r = (r << 8) | p[i - 1];
+    }
+    return r;
+}
+
+// Header fields of a PHYPayload. The payload itself isn't copied so must
+// outlive the frame.
+struct Frame
+{
+    const uint8_t *phy = nullptr;
+    size_t len = 0;
+    uint8_t mtype = 0;
+    uint8_t major = 0;
+    MicStatus mic = mic_invalid;
+
+    // Data frames
+    uint32_t dev_addr = 0;
+    uint8_t fctrl = 0;
+    uint32_t fcnt = 0; // 16 bits from the frame, extended once verified
+    size_t fopts_len = 0;
+    int fport = -1;
+
+    bool decode(const uint8_t *phy, const size_t len)
+    {
+        this->phy = phy;
+        this->len = len;
+        mic = mic_invalid;
+
+        if (len < 1 + MIC_SIZE)
+        {
+            return false;
+        }
+
+        mtype = phy[0] >> 5;
+        major = phy[0] & 0x3;
+
+        // Gateways only receive downlinks from other gateways, never from
+        // devices, so these are forged or corrupt
+        if ((mtype == JOIN_ACCEPT) ||
+            (mtype == UNCONFIRMED_DATA_DOWN) ||
+            (mtype == CONFIRMED_DATA_DOWN))
+        {
+            return false;
+        }
+
+        if (is_data())
+        {
+            if (len < DATA_HEADER_SIZE + MIC_SIZE)
+            {
+                return false;
+            }
+            dev_addr = get_le(&phy[1], 4);
+            fctrl = phy[5];
+            fcnt = get_le(&phy[6], 2);
+            fopts_len = fctrl & 0xf;
+            size_t fhdr_end = DATA_HEADER_SIZE + fopts_len;
+            if (len < fhdr_end + MIC_SIZE)
+            {
+                return false;
+            }
+            fport = (len > fhdr_end + MIC_SIZE) ? phy[fhdr_end] : -1;
+        }
+        else if ((mtype == JOIN_REQUEST) && (len != JOIN_REQUEST_SIZE))
+        {
+            return false;
+        }
+
+        mic = is_uplink_data() ? mic_unknown : mic_none;
+        return true;
+    }
+
+    bool is_data() const
+    {
+        return (mtype >= UNCONFIRMED_DATA_UP) && (mtype <= CONFIRMED_DATA_DOWN);
+    }
+
+    bool is_uplink_data() const
+    {
+        return (mtype == UNCONFIRMED_DATA_UP) || (mtype == CONFIRMED_DATA_UP);
+    }
+
+    uint32_t get_mic() const
+    {
+        return get_le(&phy[len - MIC_SIZE], MIC_SIZE);
+    }
+
+    // Fields as the members of a JSON object
+    std::string to_json() const
+    {
+        char buf[256];
+        std::string r = "{";
+
+        snprintf(buf, sizeof(buf), "\"mtype\":%u,\"major\":%u",
+                 mtype, major);
+        r += buf;
+
+        if (mic == mic_invalid)
+        {
+            // fields may not have been decoded
+        }
+        else if (is_data())
+        {
+            snprintf(buf, sizeof(buf),
+                     ",\"dev_addr\":\"%08x\",\"adr\":%s,\"adr_ack_req\":%s"
+                     ",\"ack\":%s,\"fpending\":%s,\"fcnt\":%u,\"fopts\":\"",
+                     dev_addr,
+                     (fctrl & 0x80) ? "true" : "false",
+                     (fctrl & 0x40) ? "true" : "false",
+                     (fctrl & 0x20) ? "true" : "false",
+                     (fctrl & 0x10) ? "true" : "false",
+                     fcnt);
+            r += buf;
+            r += hex(&phy[DATA_HEADER_SIZE], fopts_len, false);
+            r += "\"";
+            if (fport >= 0)
+            {
+                r += ",\"fport\":" + std::to_string(fport);
+            }
+        }
+        else if (mtype == JOIN_REQUEST)
+        {
+            r += ",\"join_eui\":\"" + hex(&phy[1], 8, true) +
+                 "\",\"dev_eui\":\"" + hex(&phy[9], 8, true) +
+                 "\",\"dev_nonce\":" + std::to_string(get_le(&phy[17], 2));
+        }
+
+        r += ",\"mic\":\"";
+        r += mic_status_name(mic);
+        r += "\"}";
+        return r;
+    }
+
+private:
+    static std::string hex(const uint8_t *p, const size_t n, const bool reverse)
+    {
+        std::string r;
+        char buf[3];
+        for (size_t i = 0; i < n; ++i)
+        {
+            snprintf(buf, sizeof(buf), "%02x", p[reverse ? n - 1 - i : i]);
+            r += buf;
+        }
+        return r;
+    }
+};
+
+// Network session keys of activated devices, keyed by DevAddr. Verifies the
+// MICs of uplink data frames (LoRaWAN 1.0.x) in batches, whichever devices
+// they come from.
+class MicVerifier
+{
+public:
+    bool set_session(const uint32_t dev_addr,
+                     const uint8_t (&nwk_s_key)[KEY_SIZE],
+                     const uint32_t fcnt)
+    {
+        std::unique_ptr<Session> session(new Session());
+        if (!session->cmac.set_key(nwk_s_key))
+        {
+            return false;
+        }
+        session->fcnt = fcnt;
+
+        std::unique_lock<std::mutex> lock(m);
+        sessions[dev_addr] = std::move(session);
+        return true;
+    }
+
+    void remove_session(const uint32_t dev_addr)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        sessions.erase(dev_addr);
+    }
+
+    void clear()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        sessions.clear();
+    }
+
+    size_t size()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        return sessions.size();
+    }
+
+    // Sets the mic status of decoded uplink data frames. All their MICs are
+    // computed together.
+    void verify(std::vector<Frame>& frames)
+    {
+        std::unique_lock<std::mutex> lock(m);
+
+        std::vector<Frame*> batch;
+        std::vector<Session*> batch_sessions;
+        for (auto& frame : frames)
+        {
+            if (frame.mic != mic_unknown)
+            {
+                continue;
+            }
+            auto it = sessions.find(frame.dev_addr);
+            if (it != sessions.end())
+            {
+                batch.push_back(&frame);
+                batch_sessions.push_back(it->second.get());
+            }
+        }
+
+        std::vector<std::vector<uint8_t>> bufs(batch.size());
+        std::vector<Cmac::Message> msgs(batch.size());
+        std::vector<Cmac::Message*> ptrs;
+
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            Frame& frame = *batch[i];
+            Session& session = *batch_sessions[i];
+
+            // Extend the counter using the most significant bits of the
+            // last one seen, allowing for it to have wrapped (but not for
+            // retransmissions to be mistaken for wrapping)
+            uint32_t fcnt = (session.fcnt & 0xffff0000) | frame.fcnt;
+            if ((fcnt < session.fcnt) && (session.fcnt - fcnt > 0x8000))
+            {
+                fcnt += 0x10000;
+            }
+            frame.fcnt = fcnt;
+
+            // B0 block followed by the frame without its MIC
+            size_t msg_len = frame.len - MIC_SIZE;
+            auto& buf = bufs[i];
+            buf.assign(Cmac::BLOCK_SIZE + msg_len, 0);
+            buf[0] = 0x49;
+            buf[5] = 0; // uplink
+            for (int j = 0; j < 4; ++j)
+            {
+                buf[6 + j] = (frame.dev_addr >> (8 * j)) & 0xff;
+                buf[10 + j] = (fcnt >> (8 * j)) & 0xff;
+            }
+            buf[15] = static_cast<uint8_t>(msg_len);
+            std::copy(frame.phy, &frame.phy[msg_len], &buf[Cmac::BLOCK_SIZE]);
+
+            msgs[i].key = &session.cmac;
+            msgs[i].data = buf.data();
+            msgs[i].len = buf.size();
+            ptrs.push_back(&msgs[i]);
+        }
+
+        if (!Cmac::compute(ptrs))
+        {
+            return;
+        }
+
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            Frame& frame = *batch[i];
+            Session& session = *batch_sessions[i];
+            if (get_le(msgs[i].mac, MIC_SIZE) == frame.get_mic())
+            {
+                frame.mic = mic_ok;
+                session.fcnt = std::max(session.fcnt, frame.fcnt);
+            }
+            else
+            {
+                frame.mic = mic_fail;
+            }
+        }
+    }
+
+private:
+    struct Session
+    {
+        Cmac cmac;
+        uint32_t fcnt;
+    };
+
+    std::mutex m;
+    std::unordered_map<uint32_t, std::unique_ptr<Session>> sessions;
+};
+
+}
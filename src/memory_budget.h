@@ -0,0 +1,226 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <sys/types.h>
+
+enum BudgetAccount
+{
+    budget_uplink,
+    budget_downlink,
+    budget_log_info,
+    budget_log_error,
+    budget_accounts
+};
+
+struct BudgetUsage
+{
+    size_t used = 0;
+    size_t limit = 0;
+    int priority = 0;
+    uint64_t dropped = 0;
+    uint64_t shed = 0;
+};
+
+// Process-wide limit on the memory held in the addon's link and log queues.
+//
+// Each account (queue) may use up to its share of the budget. Shares can add
+// up to more than the whole budget; when the total would be exceeded, memory
+// is shed from accounts with a lower priority (by discarding their oldest
+// messages) before the allocation is refused. A budget of 0 means unlimited
+// but usage is still tracked.
+class MemoryBudget
+{
+public:
+    typedef std::function<size_t(size_t)> Shedder;
+
+    MemoryBudget()
+    {
+        const int priorities[budget_accounts] = { 2, 2, 0, 1 };
+        for (int i = 0; i < budget_accounts; ++i)
+        {
+            accounts[i].priority = priorities[i];
+        }
+    }
+
+    void configure(const size_t budget,
+                   const double (&shares)[budget_accounts],
+                   const int (&priorities)[budget_accounts])
+    {
+        std::unique_lock<std::mutex> lock(m);
+        this->budget = budget;
+        for (int i = 0; i < budget_accounts; ++i)
+        {
+            accounts[i].limit = static_cast<size_t>(budget * shares[i]);
+            accounts[i].priority = priorities[i];
+        }
+    }
+
+    size_t get_budget()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        return budget;
+    }
+
+    // Called with the number of bytes wanted; returns the number of messages
+    // discarded.
+    void set_shedder(const BudgetAccount account, const Shedder& shedder)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        accounts[account].shedder = shedder;
+    }
+
+    // Limit for a queue held outside the addon, or -1 if there's no budget.
+    ssize_t limit(const BudgetAccount account)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        return budget > 0 ? static_cast<ssize_t>(accounts[account].limit) : -1;
+    }
+
+    bool charge(const BudgetAccount account, const size_t bytes)
+    {
+        if (try_charge(account, bytes))
+        {
+            return true;
+        }
+
+        auto& a = accounts[account];
+        std::vector<std::pair<int, Shedder>> shedders;
+
+        {
+            std::unique_lock<std::mutex> lock(m);
+            if ((a.used + bytes > a.limit) || (bytes > budget))
+            {
+                ++a.dropped;
+                return false;
+            }
+
+            // lowest priority first
+            std::vector<int> order;
+            for (int i = 0; i < budget_accounts; ++i)
+            {
+                if (accounts[i].shedder && (accounts[i].priority < a.priority))
+                {
+                    order.push_back(i);
+                }
+            }
+            std::stable_sort(order.begin(), order.end(), [this](int x, int y)
+            {
+                return accounts[x].priority < accounts[y].priority;
+            });
+            for (int i : order)
+            {
+                shedders.emplace_back(i, accounts[i].shedder);
+            }
+        }
+
+        for (auto& shedder : shedders)
+        {
+            size_t total = used.load();
+            if (total + bytes <= budget)
+            {
+                break;
+            }
+            accounts[shedder.first].shed +=
+                shedder.second(total + bytes - budget);
+        }
+
+        if (try_charge(account, bytes))
+        {
+            return true;
+        }
+
+        ++a.dropped;
+        return false;
+    }
+
+    void release(const BudgetAccount account, const size_t bytes)
+    {
+        accounts[account].used -= bytes;
+        used -= bytes;
+    }
+
+    size_t get_used()
+    {
+        return used;
+    }
+
+    BudgetUsage get_usage(const BudgetAccount account)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        auto& a = accounts[account];
+        BudgetUsage r;
+        r.used = a.used;
+        r.limit = a.limit;
+        r.priority = a.priority;
+        r.dropped = a.dropped;
+        r.shed = a.shed;
+        return r;
+    }
+
+private:
+    struct Account
+    {
+        std::atomic<size_t> used{0};
+        size_t limit = 0;
+        int priority = 0;
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> shed{0};
+        Shedder shedder;
+    };
+
+    bool try_charge(const BudgetAccount account, const size_t bytes)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        auto& a = accounts[account];
+
+        if ((budget > 0) &&
+            ((a.used + bytes > a.limit) || (used + bytes > budget)))
+        {
+            return false;
+        }
+
+        a.used += bytes;
+        used += bytes;
+        return true;
+    }
+
+    std::mutex m;
+    size_t budget = 0;
+    std::atomic<size_t> used{0};
+    Account accounts[budget_accounts];
+};
+
+inline MemoryBudget& memory_budget()
+{
+    static MemoryBudget budget;
+    return budget;
+}
+
+// Allocates a packet charged to a budget account. The charge is released
+// when the last reference to the packet goes away. Returns nullptr if the
+// budget doesn't allow it.
+template<class... Args>
+std::shared_ptr<const std::vector<uint8_t>> make_packet(const BudgetAccount account,
+                                                        Args&&... args)
+{
+    auto data = new std::vector<uint8_t>(std::forward<Args>(args)...);
+    const size_t size = data->size();
+
+    if (!memory_budget().charge(account, size))
+    {
+        delete data;
+        return nullptr;
+    }
+
+    return std::shared_ptr<const std::vector<uint8_t>>(data,
+        [account, size](const std::vector<uint8_t> *data)
+        {
+            memory_budget().release(account, size);
+            delete data;
+        });
+}
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <sys/types.h>
+#include "memory_budget.h"
+#include "timer_wheel.h"
+
+typedef std::shared_ptr<const std::vector<uint8_t>> Packet;
+
+// Queue lengths at which to tell the application about congestion. A
+// negative high watermark disables that measure. Once either measure reaches
+// its high watermark, the queue is congested until every enabled measure is
+// at or below its low watermark.
+struct Watermarks
+{
+    ssize_t low_packets = -1;
+    ssize_t high_packets = -1;
+    ssize_t low_bytes = -1;
+    ssize_t high_bytes = -1;
+};
+
+// Called with true when a queue becomes congested and false when it recovers,
+// along with its length in packets and bytes. Runs on the thread which
+// changed the queue, while it's locked, so mustn't block or use the queue.
+typedef std::function<void(bool, size_t, size_t)> WatermarkCallback;
+
+struct QueueStats
+{
+    size_t packets = 0;
+    size_t bytes = 0;
+    bool congested = false;
+};
+
+// Queue of packets produced by the addon's own threads. It has the same
+// semantics as the shared library's queues: a negative timeout blocks, zero
+// polls, a negative high-water mark is unbounded and EAGAIN/EBADF are
+// reported through errno.
+class PacketQueue
+{
+public:
+    void reset()
+    {
+        std::unique_lock<std::mutex> lock(*m);
+        closed = false;
+        close_pending = false;
+        congested = false;
+    }
+
+    // If immediately is false, the queue closes once it's been drained.
+    void close(const bool immediately = true)
+    {
+        std::unique_lock<std::mutex> lock(*m);
+        close_pending = true;
+        if (immediately || q.empty())
+        {
+            decltype(q) empty;
+            std::swap(q, empty);
+            size = 0;
+            closed = true;
+            check_watermarks();
+            wake(send_waiters);
+            wake(recv_waiters);
+        }
+    }
+
+    void set_watermarks(const Watermarks& watermarks,
+                        const WatermarkCallback& callback)
+    {
+        std::unique_lock<std::mutex> lock(*m);
+        this->watermarks = watermarks;
+        watermark_callback = callback;
+        congested = false;
+        check_watermarks();
+    }
+
+    bool has_watermarks()
+    {
+        std::unique_lock<std::mutex> lock(*m);
+        return (watermarks.high_packets >= 0) || (watermarks.high_bytes >= 0);
+    }
+
+    QueueStats get_stats()
+    {
+        std::unique_lock<std::mutex> lock(*m);
+        QueueStats r;
+        r.packets = q.size();
+        r.bytes = size;
+        r.congested = congested;
+        return r;
+    }
+
+    void send(const Packet& pkt)
+    {
+        send(pkt, -1, std::chrono::microseconds(-1));
+    }
+
+    ssize_t send(const Packet& pkt,
+                 const ssize_t hwm,
+                 const std::chrono::microseconds& timeout)
+    {
+        std::unique_lock<std::mutex> lock(*m);
+
+        if (closed)
+        {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (hwm == 0)
+        {
+            return 0;
+        }
+
+        if ((hwm > 0) && (static_cast<ssize_t>(size) >= hwm))
+        {
+            int err = wait(timeout, lock, send_waiters, [this, hwm]
+            {
+                return static_cast<ssize_t>(size) < hwm;
+            });
+            if (err != 0)
+            {
+                errno = err;
+                return -1;
+            }
+        }
+
+        q.push_back(pkt);
+        size += pkt->size();
+        check_watermarks();
+        wake(recv_waiters);
+        return pkt->size();
+    }
+
+    ssize_t recv(void *buf, size_t len, const std::chrono::microseconds& timeout)
+    {
+        std::unique_lock<std::mutex> lock(*m);
+
+        if (closed)
+        {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (q.empty())
+        {
+            if (close_pending)
+            {
+                closed = true;
+                errno = EBADF;
+                return -1;
+            }
+
+            int err = wait(timeout, lock, recv_waiters, [this]
+            {
+                return !q.empty();
+            });
+            if (err != 0)
+            {
+                errno = err;
+                return -1;
+            }
+        }
+
+        auto pkt = q.front();
+        q.pop_front();
+        size -= pkt->size();
+        check_watermarks();
+        wake(send_waiters);
+        lock.unlock();
+
+        ssize_t r = std::min(pkt->size(), len);
+        memcpy(buf, pkt->data(), r);
+        return r;
+    }
+
+    // Discards the oldest packets until at least bytes have been freed.
+    // Packets also referenced elsewhere (e.g. by a broadcast ring) are kept,
+    // since discarding them wouldn't free anything. Returns the number of
+    // packets discarded.
+    size_t shed(const size_t bytes)
+    {
+        std::vector<Packet> discarded;
+
+        {
+            std::unique_lock<std::mutex> lock(*m);
+            size_t freed = 0;
+            auto it = q.begin();
+            while ((freed < bytes) && (it != q.end()))
+            {
+                if (it->use_count() > 1)
+                {
+                    ++it;
+                    continue;
+                }
+                freed += (*it)->size();
+                size -= (*it)->size();
+                discarded.push_back(std::move(*it));
+                it = q.erase(it);
+            }
+            if (!discarded.empty())
+            {
+                check_watermarks();
+                wake(send_waiters);
+            }
+        }
+
+        // packets are released here, outside the lock
+        return discarded.size();
+    }
+
+private:
+    // Called with the lock held whenever the queue's length changes
+    void check_watermarks()
+    {
+        if (!watermark_callback)
+        {
+            return;
+        }
+
+        const ssize_t packets = q.size(), bytes = size;
+
+        if (!congested)
+        {
+            congested = ((watermarks.high_packets >= 0) &&
+                         (packets >= watermarks.high_packets)) ||
+                        ((watermarks.high_bytes >= 0) &&
+                         (bytes >= watermarks.high_bytes));
+            if (congested)
+            {
+                watermark_callback(true, packets, bytes);
+            }
+        }
+        else if (((watermarks.high_packets < 0) ||
+                  (packets <= std::max(watermarks.low_packets, ssize_t(0)))) &&
+                 ((watermarks.high_bytes < 0) ||
+                  (bytes <= std::max(watermarks.low_bytes, ssize_t(0)))))
+        {
+            congested = false;
+            watermark_callback(false, packets, bytes);
+        }
+    }
+
+    // A call waiting for the queue to change. Timed calls are also put in
+    // the shared timer wheel, which wakes just that call when its timeout
+    // expires, rather than each call doing its own timed wait. The call takes
+    // its waiter out of the wheel when it returns, but the wheel's thread may
+    // be about to expire it, so it shares the queue's mutex rather than
+    // referring to the queue.
+    class Waiter : public TimerWheel::Timer
+    {
+    public:
+        explicit Waiter(const std::shared_ptr<std::mutex>& m) :
+            m(m)
+        {
+        }
+
+        void expire() override
+        {
+            {
+                std::unique_lock<std::mutex> lock(*m);
+                if (is_cancelled())
+                {
+                    return;
+                }
+                expired = true;
+            }
+            cv.notify_one();
+        }
+
+        std::condition_variable cv;
+        bool expired = false;
+
+    private:
+        std::shared_ptr<std::mutex> m;
+    };
+
+    // Called with the lock held
+    static void wake(const std::list<Waiter*>& waiters)
+    {
+        for (auto waiter : waiters)
+        {
+            waiter->cv.notify_one();
+        }
+    }
+
+    template<class Predicate>
+    int wait(const std::chrono::microseconds& timeout,
+             std::unique_lock<std::mutex>& lock,
+             std::list<Waiter*>& waiters,
+             Predicate pred)
+    {
+        if (timeout == std::chrono::microseconds::zero())
+        {
+            return EAGAIN;
+        }
+
+        auto waiter = std::make_shared<Waiter>(m);
+        auto it = waiters.insert(waiters.end(), waiter.get());
+        if (timeout > std::chrono::microseconds::zero())
+        {
+            timer_wheel().add(waiter, timeout);
+        }
+
+        waiter->cv.wait(lock, [this, &pred, &waiter]
+        {
+            return closed || pred() || waiter->expired;
+        });
+        if (timeout > std::chrono::microseconds::zero())
+        {
+            // Lock order is the queue and then the wheel
+            timer_wheel().cancel(*waiter);
+        }
+        waiters.erase(it);
+
+        if (closed)
+        {
+            return EBADF;
+        }
+
+        if (!pred())
+        {
+            return EAGAIN;
+        }
+
+        return 0;
+    }
+
+    std::shared_ptr<std::mutex> m = std::make_shared<std::mutex>();
+    std::list<Waiter*> send_waiters, recv_waiters;
+    std::deque<Packet> q;
+    size_t size = 0;
+    bool closed = false;
+    bool close_pending = false;
+    Watermarks watermarks;
+    WatermarkCallback watermark_callback;
+    bool congested = false;
+};
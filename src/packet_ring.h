@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "packet_queue.h"
+
+enum SlowConsumerPolicy
+{
+    policy_block,       // publisher waits for the subscriber to catch up
+    policy_drop,        // subscriber loses its oldest unread packet
+    policy_disconnect   // subscriber is closed with ECONNRESET
+};
+
+struct SubscriptionStats
+{
+    uint64_t received = 0;
+    uint64_t dropped = 0;
+    uint64_t lag = 0;
+    uint64_t max_lag = 0;
+    bool disconnected = false;
+};
+
+// Fixed-size ring of packets shared by any number of subscribers. Each
+// packet is stored once; subscribers have their own cursors into the ring
+// and are handed references to the packets rather than copies.
+//
+// Reads never block. When a subscriber has nothing to read, its notify
+// function is called (with the ring locked) the next time a packet is
+// published or the ring is closed.
+class PacketRing
+{
+public:
+    class Subscription
+    {
+    public:
+        Subscription(const SlowConsumerPolicy policy,
+                     const std::function<void()>& notify) :
+            policy(policy),
+            notify(notify)
+        {
+        }
+
+    private:
+        friend class PacketRing;
+
+        const SlowConsumerPolicy policy;
+        std::function<void()> notify;
+        uint64_t cursor = 0;
+        bool armed = true;
+        bool closed = false;
+        SubscriptionStats stats;
+    };
+
+    void configure(const size_t capacity)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        clear();
+        slots.assign(capacity, Packet());
+    }
+
+    size_t capacity()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        return slots.size();
+    }
+
+    void reset()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        clear();
+        closed = false;
+    }
+
+    void close()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        closed = true;
+        std::fill(slots.begin(), slots.end(), Packet());
+        for (auto& sub : subs)
+        {
+            sub->closed = true;
+            wake(*sub);
+        }
+        publish_cv.notify_all();
+    }
+
+    std::shared_ptr<Subscription> subscribe(const SlowConsumerPolicy policy,
+                                            const std::function<void()>& notify)
+    {
+        auto sub = std::make_shared<Subscription>(policy, notify);
+        std::unique_lock<std::mutex> lock(m);
+        sub->cursor = head;
+        if (closed || slots.empty())
+        {
+            sub->closed = true;
+        }
+        else
+        {
+            subs.push_back(sub);
+        }
+        return sub;
+    }
+
+    void unsubscribe(const std::shared_ptr<Subscription>& sub)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        sub->closed = true;
+        sub->notify = nullptr;
+        auto it = std::find(subs.begin(), subs.end(), sub);
+        if (it != subs.end())
+        {
+            subs.erase(it);
+            release();
+            publish_cv.notify_all();
+        }
+    }
+
+    void publish(const Packet& pkt)
+    {
+        std::unique_lock<std::mutex> lock(m);
+
+        if (slots.empty())
+        {
+            return;
+        }
+
+        publish_cv.wait(lock, [this]
+        {
+            if (closed)
+            {
+                return true;
+            }
+            for (auto& sub : subs)
+            {
+                if ((sub->policy == policy_block) && full(*sub))
+                {
+                    return false;
+                }
+            }
+            return true;
+        });
+
+        if (closed)
+        {
+            return;
+        }
+
+        for (auto& sub : subs)
+        {
+            if (full(*sub))
+            {
+                if (sub->policy == policy_drop)
+                {
+                    ++sub->cursor;
+                    ++sub->stats.dropped;
+                }
+                else
+                {
+                    // let the subscriber know even if it isn't reading
+                    sub->closed = true;
+                    sub->stats.disconnected = true;
+                    sub->armed = true;
+                }
+            }
+        }
+
+        slots[head % slots.size()] = pkt;
+        ++head;
+
+        for (auto it = subs.begin(); it != subs.end();)
+        {
+            auto& sub = **it;
+            sub.stats.lag = head - sub.cursor;
+            sub.stats.max_lag = std::max(sub.stats.max_lag, sub.stats.lag);
+            wake(sub);
+            it = sub.closed ? subs.erase(it) : it + 1;
+        }
+
+        release();
+    }
+
+    // Returns 0 and sets pkt, or returns EAGAIN, EBADF or ECONNRESET.
+    int recv(Subscription& sub, Packet& pkt)
+    {
+        std::unique_lock<std::mutex> lock(m);
+
+        if (sub.closed)
+        {
+            return sub.stats.disconnected ? ECONNRESET : EBADF;
+        }
+
+        if (sub.cursor == head)
+        {
+            sub.armed = true;
+            return EAGAIN;
+        }
+
+        pkt = slots[sub.cursor % slots.size()];
+        ++sub.cursor;
+        ++sub.stats.received;
+        sub.stats.lag = head - sub.cursor;
+        release();
+        publish_cv.notify_all();
+        return 0;
+    }
+
+    SubscriptionStats stats(const Subscription& sub)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        return sub.stats;
+    }
+
+private:
+    void clear()
+    {
+        for (auto& sub : subs)
+        {
+            sub->closed = true;
+        }
+        subs.clear();
+        std::fill(slots.begin(), slots.end(), Packet());
+        head = 0;
+        released = 0;
+    }
+
+    bool full(const Subscription& sub) const
+    {
+        return (head - sub.cursor) >= slots.size();
+    }
+
+    void wake(Subscription& sub)
+    {
+        if (sub.armed && sub.notify)
+        {
+            sub.armed = false;
+            sub.notify();
+        }
+    }
+
+    // Drops the ring's references to packets every subscriber has read.
+    void release()
+    {
+        uint64_t tail = head;
+        for (auto& sub : subs)
+        {
+            tail = std::min(tail, sub->cursor);
+        }
+        uint64_t oldest = (head > slots.size()) ? head - slots.size() : 0;
+        for (uint64_t seq = std::max(released, oldest); seq < tail; ++seq)
+        {
+            slots[seq % slots.size()].reset();
+        }
+        released = std::max(released, tail);
+    }
+
+    std::mutex m;
+    std::condition_variable publish_cv;
+    std::vector<Packet> slots;
+    std::vector<std::shared_ptr<Subscription>> subs;
+    uint64_t head = 0;
+    uint64_t released = 0;
+    bool closed = false;
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cerrno>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+
+struct ThreadOptions
+{
+    std::vector<int> cpus;      // empty leaves affinity alone
+    int policy = SCHED_OTHER;   // SCHED_FIFO and SCHED_RR use priority
+    int priority = 0;
+};
+
+struct ThreadSettings
+{
+    bool applied = false;
+    std::vector<int> cpus;
+    int policy = SCHED_OTHER;
+    int priority = 0;
+    int affinity_error = 0;
+    int sched_error = 0;
+};
+
+// Applies options to the calling thread and returns the settings it ended up
+// with. Threads it creates afterwards inherit them. Failures (typically EPERM
+// for real-time policies without CAP_SYS_NICE) are reported rather than
+// treated as fatal.
+inline ThreadSettings apply_thread_options(const ThreadOptions& options)
+{
+    ThreadSettings r;
+    r.applied = true;
+    pthread_t self = pthread_self();
+
+    if (!options.cpus.empty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : options.cpus)
+        {
+            if ((cpu >= 0) && (cpu < CPU_SETSIZE))
+            {
+                CPU_SET(cpu, &set);
+            }
+        }
+        r.affinity_error = pthread_setaffinity_np(self, sizeof(set), &set);
+    }
+
+    if ((options.policy == SCHED_FIFO) || (options.policy == SCHED_RR))
+    {
+        struct sched_param param;
+        param.sched_priority = options.priority;
+        r.sched_error = pthread_setschedparam(self, options.policy, &param);
+    }
+
+    cpu_set_t set;
+    if (pthread_getaffinity_np(self, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                r.cpus.push_back(cpu);
+            }
+        }
+    }
+
+    struct sched_param param;
+    if (pthread_getschedparam(self, &r.policy, &param) == 0)
+    {
+        r.priority = param.sched_priority;
+    }
+
+    return r;
+}
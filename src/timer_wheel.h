@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+// Hierarchical timer wheel shared by every timed wait in the addon.
+//
+// Deadlines are rounded up to a whole tick (100us by default) and kept in one
+// of four levels of 64 slots, each level's slot spanning a full turn of the
+// level below. Each
+// slot is an intrusive list, so adding or cancelling a timer is constant time
+// and a cancelled timer leaves the wheel straight away. A single thread wakes
+// at most once a tick, and only for ticks which have something due or a slot
+// to cascade down, and expires everything due at once. Timeouts therefore
+// cost the same however many calls are waiting.
+class TimerWheel
+{
+    struct Node
+    {
+        Node *prev = nullptr;
+        Node *next = nullptr;
+    };
+
+public:
+    typedef std::chrono::steady_clock clock;
+
+    class Timer : private Node
+    {
+    public:
+        virtual ~Timer() {}
+
+        // Called on the wheel's thread, without the wheel locked, once the
+        // deadline has passed, unless the timer was cancelled beforehand.
+        // TimerWheel::cancel() can still race with it, so expire() should
+        // check is_cancelled() under the same lock the canceller holds.
+        virtual void expire() = 0;
+
+        bool is_cancelled() const
+        {
+            return cancelled;
+        }
+
+    private:
+        friend class TimerWheel;
+        std::atomic<bool> cancelled{false};
+        uint64_t tick = 0;
+        // Keeps the timer alive while it's in the wheel
+        std::shared_ptr<Timer> self;
+    };
+
+    explicit TimerWheel(const std::chrono::nanoseconds& tick_length = 100us) :
+        tick_length(tick_length),
+        epoch(clock::now())
+    {
+        for (auto& level : slots)
+        {
+            for (auto& slot : level)
+            {
+                slot.prev = slot.next = &slot;
+            }
+        }
+    }
+
+    ~TimerWheel()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m);
+            stopping = true;
+            cv.notify_one();
+        }
+
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+
+        for (auto& level : slots)
+        {
+            for (auto& slot : level)
+            {
+                while (slot.next != &slot)
+                {
+                    unlink(static_cast<Timer*>(slot.next))->self.reset();
+                }
+            }
+        }
+    }
+
+    void add(const std::shared_ptr<Timer>& timer,
+             const std::chrono::microseconds& timeout)
+    {
+        std::unique_lock<std::mutex> lock(m);
+
+        // Worked out with the lock held so the wheel can't turn past the
+        // deadline before the timer is in it
+        const auto now = clock::now();
+        if (pending == 0)
+        {
+            // The wheel doesn't turn while it's empty
+            current = to_tick(now);
+        }
+
+        timer->tick = (now - epoch + timeout + tick_length - 1ns) / tick_length;
+        timer->self = timer;
+        // The current tick's slot may already have been expired
+        insert(timer.get(), current + 1);
+        ++pending;
+
+        if (!thread.joinable())
+        {
+            thread = std::thread(&TimerWheel::run, this);
+        }
+        else if (timer->tick < next_wake)
+        {
+            cv.notify_one();
+        }
+    }
+
+    // Removes the timer from the wheel, if it's still there, and stops it
+    // expiring
+    void cancel(Timer& timer)
+    {
+        std::shared_ptr<Timer> self;
+
+        {
+            std::unique_lock<std::mutex> lock(m);
+            timer.cancelled = true;
+            if (timer.next)
+            {
+                unlink(&timer);
+                --pending;
+                std::swap(self, timer.self);
+            }
+        }
+
+        // the wheel's reference is released here, outside the lock
+    }
+
+    // Number of timers in the wheel
+    size_t size()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        return pending;
+    }
+
+private:
+    static const unsigned int level_bits = 6;
+    static const size_t levels = 4;
+    static const uint64_t slot_mask = (1 << level_bits) - 1;
+
+    uint64_t to_tick(const clock::time_point& t) const
+    {
+        return (t - epoch) / tick_length;
+    }
+
+    // Called with the lock held
+    static Timer *unlink(Timer *timer)
+    {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = timer->next = nullptr;
+        return timer;
+    }
+
+    // Called with the lock held. Moves the slot's timers to an empty list.
+    static void take(Node& slot, Node& list)
+    {
+        if (slot.next == &slot)
+        {
+            return;
+        }
+        list.next = slot.next;
+        list.prev = slot.prev;
+        list.next->prev = list.prev->next = &list;
+        slot.prev = slot.next = &slot;
+    }
+
+    // Called with the lock held. Timers already due go in the earliest slot.
+    void insert(Timer *timer, const uint64_t earliest)
+    {
+        uint64_t t = std::max(timer->tick, earliest);
+        size_t level = 0;
+        while ((level < levels - 1) &&
+               ((t - current) >> (level_bits * (level + 1))) != 0)
+        {
+            ++level;
+        }
+
+        // Deadlines beyond the top level are parked in its furthest slot
+        // and placed again when that slot cascades
+        const uint64_t span = uint64_t(1) << (level_bits * levels);
+        if (t - current >= span)
+        {
+            t = current + span - 1;
+        }
+
+        Node& slot = slots[level][(t >> (level_bits * level)) & slot_mask];
+        timer->prev = slot.prev;
+        timer->next = &slot;
+        slot.prev->next = timer;
+        slot.prev = timer;
+    }
+
+    // Called with the lock held. Returns the next tick which has timers due
+    // or slots to cascade.
+    uint64_t next_tick() const
+    {
+        uint64_t t = current + 1;
+        while (((t & slot_mask) != 0) &&
+               (slots[0][t & slot_mask].next == &slots[0][t & slot_mask]))
+        {
+            ++t;
+        }
+        return t;
+    }
+
+    // Called with the lock held. Turns the wheel up to the tick and collects
+    // the timers which are due.
+    void advance(const uint64_t tick, std::vector<std::shared_ptr<Timer>>& due)
+    {
+        Node timers;
+        timers.prev = timers.next = &timers;
+
+        while (current < tick)
+        {
+            ++current;
+
+            for (size_t level = 1; level < levels; ++level)
+            {
+                if ((current & ((uint64_t(1) << (level_bits * level)) - 1)) != 0)
+                {
+                    break;
+                }
+
+                take(slots[level][(current >> (level_bits * level)) & slot_mask],
+                     timers);
+                // The current tick's slot is expired after cascading, so
+                // timers can still go in it
+                while (timers.next != &timers)
+                {
+                    insert(unlink(static_cast<Timer*>(timers.next)), current);
+                }
+            }
+
+            take(slots[0][current & slot_mask], timers);
+            while (timers.next != &timers)
+            {
+                auto timer = unlink(static_cast<Timer*>(timers.next));
+                due.push_back(std::move(timer->self));
+                --pending;
+            }
+        }
+    }
+
+    void run()
+    {
+        std::vector<std::shared_ptr<Timer>> due;
+        std::unique_lock<std::mutex> lock(m);
+
+        while (!stopping)
+        {
+            if (pending == 0)
+            {
+                next_wake = UINT64_MAX;
+                cv.wait(lock);
+                continue;
+            }
+
+            next_wake = next_tick();
+            cv.wait_until(lock, epoch + next_wake * tick_length);
+
+            advance(to_tick(clock::now()), due);
+
+            if (!due.empty())
+            {
+                lock.unlock();
+                for (auto& timer : due)
+                {
+                    timer->expire();
+                }
+                due.clear();
+                lock.lock();
+            }
+        }
+    }
+
+    const std::chrono::nanoseconds tick_length;
+    const clock::time_point epoch;
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::thread thread;
+    bool stopping = false;
+    Node slots[levels][slot_mask + 1];
+    uint64_t current = 0;
+    uint64_t next_wake = UINT64_MAX;
+    size_t pending = 0;
+};
+
+inline TimerWheel& timer_wheel()
+{
+    static TimerWheel wheel;
+    return wheel;
+}
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std::chrono_literals;
+
+struct BridgeStats
+{
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t send_batches = 0;
+    uint64_t recv_batches = 0;
+    uint64_t send_errors = 0;
+    uint64_t recv_errors = 0;
+};
+
+// Moves packets between a link and a UDP socket connected to a network
+// server, without going through JavaScript. One thread reads packets from the
+// link and sends them with sendmmsg(); another receives datagrams with
+// recvmmsg() and writes them to the link. Both batch up to the configured
+// number of packets per system call.
+class UdpBridge
+{
+public:
+    // Read from the link with a timeout; write to the link. Both return the
+    // number of bytes or -1 and set errno. EBADF ends the bridge.
+    typedef std::function<ssize_t(void*, size_t, const std::chrono::microseconds&)> Reader;
+    typedef std::function<ssize_t(const void*, size_t)> Writer;
+
+    ~UdpBridge()
+    {
+        stop();
+        close_socket();
+    }
+
+    // Address must be numeric (IPv4 or IPv6). An empty address disables the
+    // bridge. Returns 0 or an errno value. Mustn't be called while running.
+    int configure(const std::string& address,
+                  const uint16_t port,
+                  const size_t batch,
+                  const size_t buflen)
+    {
+        close_socket();
+
+        {
+            std::unique_lock<std::mutex> lock(m);
+            stats = BridgeStats();
+        }
+
+        if (address.empty())
+        {
+            return 0;
+        }
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+        if (getaddrinfo(address.c_str(), std::to_string(port).c_str(),
+                        &hints, &res) != 0)
+        {
+            return EINVAL;
+        }
+
+        int err = 0;
+        int s = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (s < 0)
+        {
+            err = errno;
+        }
+        else if (connect(s, res->ai_addr, res->ai_addrlen) != 0)
+        {
+            err = errno;
+            close(s);
+        }
+        freeaddrinfo(res);
+
+        if (err != 0)
+        {
+            return err;
+        }
+
+        fd = s;
+        this->batch = std::max(batch, static_cast<size_t>(1));
+        this->buflen = buflen;
+        return 0;
+    }
+
+    bool is_enabled() const
+    {
+        return fd >= 0;
+    }
+
+    void start(const Reader& read, const Writer& write)
+    {
+        if (fd < 0)
+        {
+            return;
+        }
+
+        stop_requested = false;
+        to_udp = std::thread(&UdpBridge::run_to_udp, this, read);
+        from_udp = std::thread(&UdpBridge::run_from_udp, this, write);
+    }
+
+    void stop()
+    {
+        stop_requested = true;
+
+        if (to_udp.joinable())
+        {
+            to_udp.join();
+        }
+
+        if (from_udp.joinable())
+        {
+            from_udp.join();
+        }
+    }
+
+    BridgeStats get_stats()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        return stats;
+    }
+
+private:
+    void close_socket()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    void run_to_udp(Reader read)
+    {
+        std::vector<std::vector<uint8_t>> bufs(batch, std::vector<uint8_t>(buflen));
+        std::vector<struct iovec> iov(batch);
+        bool done = false;
+
+        while (!done && !stop_requested)
+        {
+            size_t n = 0;
+
+            // Wait for one packet (waking up regularly to check whether we've
+            // been asked to stop), then take any others which are ready
+            while (n < batch)
+            {
+                ssize_t r = read(bufs[n].data(), bufs[n].size(),
+                                 n == 0 ? std::chrono::microseconds(100ms) : 0us);
+                if (r < 0)
+                {
+                    done = (errno != EAGAIN);
+                    break;
+                }
+                iov[n].iov_base = bufs[n].data();
+                iov[n].iov_len = r;
+                ++n;
+            }
+
+            send_batch(iov, n);
+        }
+    }
+
+    void send_batch(std::vector<struct iovec>& iov, const size_t n)
+    {
+        if (n == 0)
+        {
+            return;
+        }
+
+        std::vector<struct mmsghdr> msgs(n);
+        memset(msgs.data(), 0, n * sizeof(struct mmsghdr));
+        for (size_t i = 0; i < n; ++i)
+        {
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        size_t sent = 0;
+        uint64_t errors = 0;
+        while (sent < n)
+        {
+            int r = sendmmsg(fd, &msgs[sent], n - sent, 0);
+            if (r < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                // e.g. ECONNREFUSED if the server isn't listening; the rest
+                // of the batch is dropped as UDP would drop it anyway
+                ++errors;
+                break;
+            }
+            sent += r;
+        }
+
+        std::unique_lock<std::mutex> lock(m);
+        stats.sent += sent;
+        ++stats.send_batches;
+        stats.send_errors += errors;
+    }
+
+    void run_from_udp(Writer write)
+    {
+        std::vector<std::vector<uint8_t>> bufs(batch, std::vector<uint8_t>(buflen));
+        std::vector<struct iovec> iov(batch);
+        std::vector<struct mmsghdr> msgs(batch);
+
+        while (!stop_requested)
+        {
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 100) <= 0)
+            {
+                continue;
+            }
+
+            memset(msgs.data(), 0, batch * sizeof(struct mmsghdr));
+            for (size_t i = 0; i < batch; ++i)
+            {
+                iov[i].iov_base = bufs[i].data();
+                iov[i].iov_len = bufs[i].size();
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            int n = recvmmsg(fd, msgs.data(), batch, MSG_DONTWAIT, nullptr);
+            if (n < 0)
+            {
+                if ((errno != EAGAIN) && (errno != EINTR))
+                {
+                    std::unique_lock<std::mutex> lock(m);
+                    ++stats.recv_errors;
+                }
+                continue;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(m);
+                stats.received += n;
+                ++stats.recv_batches;
+            }
+
+            for (int i = 0; i < n; ++i)
+            {
+                if ((write(bufs[i].data(), msgs[i].msg_len) < 0) &&
+                    (errno == EBADF))
+                {
+                    return;
+                }
+            }
+        }
+    }
+
+    int fd = -1;
+    size_t batch = 1;
+    size_t buflen = 0;
+    std::atomic<bool> stop_requested{false};
+    std::thread to_udp, from_udp;
+    std::mutex m;
+    BridgeStats stats;
+};
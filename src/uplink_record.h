@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include "gwmp.h"
+#include "lorawan.h"
+
+// Fixed-layout binary record for a frame received by the radio, delivered on
+// the uplink instead of a PUSH_DATA datagram when the binary format is
+// selected. One record is delivered per frame. Multi-byte fields are little
+// endian.
+//
+//  offset size field
+//       0    1 version  RECORD_VERSION; the top bit distinguishes records
+//                       from GWMP datagrams
+//       1    1 flags    FLAG_TIME, FLAG_TMMS, FLAG_FSK
+//       2    1 stat     int8: 1 CRC ok, -1 CRC bad, 0 no CRC
+//       3    1 chan     IF channel
+//       4    1 rfch     RF chain
+//       5    1 sf       LoRa spreading factor (0 for FSK)
+//       6    1 codr     LoRa coding rate 4/codr (0 for FSK or unknown)
+//       7    1 mic      0 if not decoded, otherwise 1 + lorawan::MicStatus
+//       8    4 tmst     uint32 internal timestamp, microseconds
+//      12    4 freq     uint32 centre frequency, Hz
+//      16    4 datr     uint32 LoRa bandwidth in Hz or FSK bitrate in bps
+//      20    2 rssi     int16 RSSI, dBm
+//      22    2 size     uint16 payload size
+//      24    4 lsnr     float32 SNR, dB (NaN for FSK)
+//      28    8 time     uint64 UTC receive time, microseconds since the epoch
+//      36    8 tmms     uint64 GPS time, milliseconds since the GPS epoch
+//      44    8 eui      gateway EUI, as in the PUSH_DATA header
+//      52    2 rcnt     uint16 copies received (more than 1 if merged)
+//      54    2 reserved 0
+//      56 size data     PHYPayload
+namespace uplink_record
+{
+
+const uint8_t RECORD_VERSION = 0x81;
+const size_t HEADER_SIZE = 56;
+
+const uint8_t FLAG_TIME = 0x01;
+const uint8_t FLAG_TMMS = 0x02;
+const uint8_t FLAG_FSK = 0x04;
+
+struct Record
+{
+    uint8_t flags = 0;
+    int8_t stat = 0;
+    uint8_t chan = 0;
+    uint8_t rfch = 0;
+    uint8_t sf = 0;
+    uint8_t codr = 0;
+    uint8_t mic = 0;
+    uint32_t tmst = 0;
+    uint32_t freq = 0;
+    uint32_t datr = 0;
+    int16_t rssi = 0;
+    float lsnr = NAN;
+    uint64_t time = 0;
+    uint64_t tmms = 0;
+    uint8_t eui[gwmp::EUI_SIZE] = {0};
+    uint16_t rcnt = 1;
+    std::vector<uint8_t> data;
+
+    // Fills in the record from an rxpk object. Returns false if it has no
+    // valid data member.
+    bool from_rxpk(const std::string &rxpk, const uint8_t *eui)
+    {
+        std::copy(eui, &eui[gwmp::EUI_SIZE], this->eui);
+        bool has_data = false;
+
+        // A single pass over the members rather than a lookup per field
+        gwmp::json::members(rxpk, 0, [&](const gwmp::json::Span &k,
+                                         const gwmp::json::Span &v)
+        {
+            std::string key = rxpk.substr(k.start, k.end - k.start);
+            std::string value = rxpk.substr(v.start, v.end - v.start);
+            std::string str = ((value.size() >= 2) && (value[0] == '"')) ?
+                value.substr(1, value.size() - 2) : std::string();
+
+            if (key == "tmst")
+            {
+                tmst = static_cast<uint32_t>(strtoull(value.c_str(), nullptr, 10));
+            }
+            else if (key == "time")
+            {
+                flags |= parse_time(str, time) ? FLAG_TIME : 0;
+            }
+            else if (key == "tmms")
+            {
+                tmms = strtoull(value.c_str(), nullptr, 10);
+                flags |= FLAG_TMMS;
+            }
+            else if (key == "freq")
+            {
+                freq = static_cast<uint32_t>(llround(strtod(value.c_str(), nullptr) * 1e6));
+            }
+            else if (key == "chan")
+            {
+                chan = static_cast<uint8_t>(strtoul(value.c_str(), nullptr, 10));
+            }
+            else if (key == "rfch")
+            {
+                rfch = static_cast<uint8_t>(strtoul(value.c_str(), nullptr, 10));
+            }
+            else if (key == "stat")
+            {
+                stat = static_cast<int8_t>(strtol(value.c_str(), nullptr, 10));
+            }
+            else if (key == "modu")
+            {
+                if (str == "FSK")
+                {
+                    flags |= FLAG_FSK;
+                }
+            }
+            else if (key == "datr")
+            {
+                unsigned int s, bw;
+                if (str.empty())
+                {
+                    datr = static_cast<uint32_t>(strtoul(value.c_str(), nullptr, 10));
+                }
+                else if (sscanf(str.c_str(), "SF%uBW%u", &s, &bw) == 2)
+                {
+                    sf = static_cast<uint8_t>(s);
+                    datr = bw * 1000;
+                }
+            }
+            else if (key == "codr")
+            {
+                unsigned int d;
+                if (sscanf(str.c_str(), "4/%u", &d) == 1)
+                {
+                    codr = static_cast<uint8_t>(d);
+                }
+            }
+            else if (key == "rssi")
+            {
+                rssi = static_cast<int16_t>(lround(strtod(value.c_str(), nullptr)));
+            }
+            else if (key == "lsnr")
+            {
+                lsnr = strtof(value.c_str(), nullptr);
+            }
+            else if (key == "rcnt")
+            {
+                rcnt = static_cast<uint16_t>(strtoul(value.c_str(), nullptr, 10));
+            }
+            else if (key == "data")
+            {
+                has_data = gwmp::base64_decode(str, data);
+            }
+            else if (key == "phy")
+            {
+                std::string name;
+                if (gwmp::json::get_string(value, "mic", name))
+                {
+                    mic = mic_from_name(name);
+                }
+            }
+        });
+
+        return has_data && (data.size() <= UINT16_MAX);
+    }
+
+    std::vector<uint8_t> serialize() const
+    {
+        std::vector<uint8_t> r(HEADER_SIZE + data.size(), 0);
+        r[0] = RECORD_VERSION;
+        r[1] = flags;
+        r[2] = static_cast<uint8_t>(stat);
+        r[3] = chan;
+        r[4] = rfch;
+        r[5] = sf;
+        r[6] = codr;
+        r[7] = mic;
+        put_le(&r[8], tmst, 4);
+        put_le(&r[12], freq, 4);
+        put_le(&r[16], datr, 4);
+        put_le(&r[20], static_cast<uint16_t>(rssi), 2);
+        put_le(&r[22], data.size(), 2);
+        uint32_t lsnr_bits;
+        memcpy(&lsnr_bits, &lsnr, sizeof(lsnr_bits));
+        put_le(&r[24], lsnr_bits, 4);
+        put_le(&r[28], time, 8);
+        put_le(&r[36], tmms, 8);
+        std::copy(std::begin(eui), std::end(eui), &r[44]);
+        put_le(&r[52], rcnt, 2);
+        std::copy(data.begin(), data.end(), &r[HEADER_SIZE]);
+        return r;
+    }
+
+private:
+    static void put_le(uint8_t *p, uint64_t v, const size_t n)
+    {
+        for (size_t i = 0; i < n; ++i, v >>= 8)
+        {
+            p[i] = v & 0xff;
+        }
+    }
+
+    static uint8_t mic_from_name(const std::string &name)
+    {
+        for (int s = lorawan::mic_ok; s <= lorawan::mic_invalid; ++s)
+        {
+            if (name == lorawan::mic_status_name(static_cast<lorawan::MicStatus>(s)))
+            {
+                return static_cast<uint8_t>(1 + s);
+            }
+        }
+        return 0;
+    }
+
+    // ISO 8601 compact, e.g. 2013-03-31T16:21:17.528002Z
+    static bool parse_time(const std::string &s, uint64_t &us)
+    {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        int consumed = 0;
+        if (sscanf(s.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d%n",
+                   &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                   &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) != 6)
+        {
+            return false;
+        }
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+
+        time_t t = timegm(&tm);
+        if (t < 0)
+        {
+            return false;
+        }
+
+        uint64_t frac = 0;
+        size_t i = consumed;
+        if ((i < s.size()) && (s[i] == '.'))
+        {
+            int digits = 0;
+            for (++i; (i < s.size()) && isdigit(s[i]); ++i)
+            {
+                if (digits < 6)
+                {
+                    frac = frac * 10 + (s[i] - '0');
+                    ++digits;
+                }
+            }
+            for (; digits < 6; ++digits)
+            {
+                frac *= 10;
+            }
+        }
+
+        us = static_cast<uint64_t>(t) * 1000000 + frac;
+        return true;
+    }
+};
+
+}
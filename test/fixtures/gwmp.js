@@ -0,0 +1,23 @@
+"use strict";
+
+// Packets injected as if they came from the forwarder, shared by the tests
+// and the benchmarks in util
+
+const crypto = require('crypto'),
+      PROTOCOL_VERSION = 2,
+      PUSH_DATA = 0;
+
+// PUSH_DATA packet with a random token from gateway aaaaaaaaaaaaaaaa
+function push_data(payload)
+{
+    const header = Buffer.alloc(12);
+    header[0] = PROTOCOL_VERSION;
+    crypto.randomFillSync(header, 1, 2);
+    header[3] = PUSH_DATA;
+    header.fill(0xaa, 4);
+    return Buffer.concat([header, Buffer.from(JSON.stringify(payload))]);
+}
+
+module.exports = {
+    push_data
+};
@@ -329,11 +329,17 @@ static std::chrono::microseconds to_microseconds(const struct timeval *tv) {
     return tv ? (tv->tv_sec * 1s + tv->tv_usec * 1us) : -1us;
 }
 
+// Like the forwarder's own messages, these go to the logger if one is set
 int log(LogQueue<std::chrono::microseconds>& logq, const char *format, ...) {
     va_list ap;
     va_start(ap, format);
 
-    return logq.write(format, ap);
+    logger_fn f = logger;
+    int r = f ? f(&logq == &log_info ? stdout : stderr, format, ap) :
+                logq.write(format, ap);
+
+    va_end(ap);
+    return r;
 }
 
 int start(const char *cfg_dir) {
@@ -0,0 +1,801 @@
+// Concurrency stress and latency-regression harness for the queue layer.
+//
+// Built against simulate.cc (node-gyp rebuild --simulate=true) so it drives
+// the same queues as the shared library through its C interface, plus the
+// addon's own packet and log queues. Each scenario runs producer and consumer threads
+// for a while and checks that no message was lost (where the scenario
+// doesn't close queues on purpose), duplicated or stuck behind a deadlock.
+// Throughput and 99th percentile latency are compared against a baseline
+// file. p99 varies several-fold between runs on a busy host, so it gets its
+// own, much wider tolerance: it catches a wait that has become a tick or a
+// timeslice long, not a few percent. A scenario which regresses is run
+// again and only fails if it regresses every time.
+//
+// Exit status is 0 on success, 1 if a check failed or performance regressed
+// and 2 if a scenario deadlocked.
+
+#include <getopt.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <lora_comms_int.h>
+#include "gwmp.h"
+#include "log_queue.h"
+#include "packet_queue.h"
+
+using namespace std::chrono_literals;
+typedef std::chrono::steady_clock clock_type;
+
+struct Options {
+    unsigned producers = 4;
+    unsigned consumers = 4;
+    std::chrono::milliseconds duration = 1000ms;
+    std::vector<std::string> scenarios;
+    std::string baseline;
+    bool update_baseline = false;
+    bool check_latency = true;
+    double tolerance = 0.5;
+    double latency_tolerance = 4;
+    unsigned retries = 2;
+};
+
+// What's sent through the queues
+struct Message {
+    uint32_t producer;
+    uint32_t cycle;
+    uint64_t seq;
+    int64_t sent_ns;
+};
+
+struct Received {
+    uint32_t producer;
+    uint32_t cycle;
+    uint64_t seq;
+};
+
+struct Result {
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t lost = 0;
+    uint64_t duplicated = 0;
+    uint64_t unexpected = 0;
+    uint64_t errors = 0;
+    double seconds = 0;
+    std::vector<int64_t> latencies_ns;
+
+    double throughput() const {
+        return seconds > 0 ? received / seconds : 0;
+    }
+
+    double percentile_us(double p) const {
+        if (latencies_ns.empty()) {
+            return 0;
+        }
+        size_t i = std::min(latencies_ns.size() - 1,
+                            static_cast<size_t>(p * latencies_ns.size()));
+        return latencies_ns[i] / 1000.0;
+    }
+
+    bool ok() const {
+        return (lost == 0) && (duplicated == 0) &&
+               (unexpected == 0) && (errors == 0);
+    }
+};
+
+// Per-thread record of what a consumer saw
+struct Consumed {
+    std::vector<Received> msgs;
+    std::vector<int64_t> latencies_ns;
+    uint64_t errors = 0;
+};
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        clock_type::now().time_since_epoch()).count();
+}
+
+static struct timeval to_timeval(const std::chrono::microseconds &us) {
+    struct timeval tv;
+    tv.tv_sec = us.count() / 1000000;
+    tv.tv_usec = us.count() % 1000000;
+    return tv;
+}
+
+// Timeouts cycled through by callers so the zero, tiny and blocking edges
+// all get exercised
+static const std::chrono::microseconds edge_timeouts[] = { 0us, 1us, 50us, 1000us };
+
+static void record(Consumed &c, const Message &msg) {
+    c.msgs.push_back({ msg.producer, msg.cycle, msg.seq });
+    c.latencies_ns.push_back(now_ns() - msg.sent_ns);
+}
+
+// Compares what was received against what each producer successfully sent
+// (sent[cycle][producer] messages numbered from 0). If lossy, messages may be
+// missing but none may be duplicated or made up.
+static void verify(Result &r,
+                   std::vector<Consumed> &consumed,
+                   const std::vector<std::vector<uint64_t>> &sent,
+                   bool lossy) {
+    std::vector<Received> all;
+    for (auto &c : consumed) {
+        all.insert(all.end(), c.msgs.begin(), c.msgs.end());
+        r.latencies_ns.insert(r.latencies_ns.end(),
+                              c.latencies_ns.begin(), c.latencies_ns.end());
+        r.errors += c.errors;
+    }
+
+    std::sort(r.latencies_ns.begin(), r.latencies_ns.end());
+    std::sort(all.begin(), all.end(), [](const Received &a, const Received &b) {
+        return std::tie(a.cycle, a.producer, a.seq) <
+               std::tie(b.cycle, b.producer, b.seq);
+    });
+
+    r.received = all.size();
+    r.sent = 0;
+    for (auto &cycle : sent) {
+        for (auto n : cycle) {
+            r.sent += n;
+        }
+    }
+
+    for (size_t i = 0; i < all.size(); ++i) {
+        auto &m = all[i];
+        if ((i > 0) &&
+            (m.cycle == all[i - 1].cycle) &&
+            (m.producer == all[i - 1].producer) &&
+            (m.seq == all[i - 1].seq)) {
+            ++r.duplicated;
+        } else if ((m.cycle >= sent.size()) ||
+                   (m.producer >= sent[m.cycle].size()) ||
+                   (m.seq >= sent[m.cycle][m.producer])) {
+            ++r.unexpected;
+        }
+    }
+
+    uint64_t distinct = r.received - r.duplicated - r.unexpected;
+    if (!lossy && (distinct < r.sent)) {
+        r.lost = r.sent - distinct;
+    }
+}
+
+// Fails the process if a scenario doesn't finish in time
+class Watchdog {
+public:
+    Watchdog(const std::string &name, const std::chrono::milliseconds &limit) :
+        thread([this, name, limit] {
+            std::unique_lock<std::mutex> lock(m);
+            if (!cv.wait_for(lock, limit, [this] { return done; })) {
+                std::cerr << name << ": deadlock (no progress after "
+                          << limit.count() << "ms)" << std::endl;
+                _exit(2);
+            }
+        }) {
+    }
+
+    ~Watchdog() {
+        {
+            std::unique_lock<std::mutex> lock(m);
+            done = true;
+        }
+        cv.notify_all();
+        thread.join();
+    }
+
+private:
+    std::mutex m;
+    std::condition_variable cv;
+    bool done = false;
+    std::thread thread;
+};
+
+// Starting and stopping the forwarder closes the link queues, discarding
+// anything left in them by an earlier scenario.
+static void clear_links() {
+    std::thread forwarder([] { start("stress"); });
+    stop();
+    forwarder.join();
+    reset();
+}
+
+typedef std::function<ssize_t(const Message&, unsigned)> SendFn;
+typedef std::function<ssize_t(Message&, unsigned)> RecvFn;
+
+// Producers send for the duration, retrying when a queue is full. Consumers
+// keep reading until everything sent has arrived or nothing has arrived for
+// a while (which verify() then reports as loss).
+static Result run_mpmc(const Options &o, SendFn send, RecvFn recv) {
+    std::vector<std::vector<uint64_t>> sent(1, std::vector<uint64_t>(o.producers));
+    std::vector<Consumed> consumed(o.consumers);
+    std::atomic<bool> producers_done{false};
+    std::atomic<uint64_t> total_sent{0}, total_received{0};
+    std::atomic<uint64_t> producer_errors{0};
+
+    auto began = clock_type::now();
+    auto deadline = began + o.duration;
+
+    std::vector<std::thread> consumers;
+    for (unsigned c = 0; c < o.consumers; ++c) {
+        consumers.emplace_back([&, c] {
+            auto &mine = consumed[c];
+            auto idle_since = clock_type::now();
+            for (unsigned i = 0; ; ++i) {
+                Message msg;
+                ssize_t r = recv(msg, i);
+                if (r == static_cast<ssize_t>(sizeof(msg))) {
+                    record(mine, msg);
+                    ++total_received;
+                    idle_since = clock_type::now();
+                } else if ((r >= 0) || (errno != EAGAIN)) {
+                    ++mine.errors;
+                    return;
+                } else if (producers_done) {
+                    if ((total_received >= total_sent) ||
+                        (clock_type::now() - idle_since > 1s)) {
+                        return;
+                    }
+                }
+            }
+        });
+    }
+
+    std::vector<std::thread> producers;
+    for (unsigned p = 0; p < o.producers; ++p) {
+        producers.emplace_back([&, p] {
+            Message msg = { p, 0, 0, 0 };
+            for (unsigned i = 0; clock_type::now() < deadline; ++i) {
+                msg.sent_ns = now_ns();
+                ssize_t r = send(msg, i);
+                if (r == static_cast<ssize_t>(sizeof(msg))) {
+                    ++msg.seq;
+                    ++total_sent;
+                } else if ((r >= 0) || (errno != EAGAIN)) {
+                    ++producer_errors;
+                    break;
+                }
+            }
+            sent[0][p] = msg.seq;
+        });
+    }
+
+    for (auto &t : producers) {
+        t.join();
+    }
+    producers_done = true;
+    for (auto &t : consumers) {
+        t.join();
+    }
+
+    Result r;
+    r.seconds = std::chrono::duration<double>(clock_type::now() - began).count();
+    verify(r, consumed, sent, false);
+    r.errors += producer_errors;
+    return r;
+}
+
+// Packets written by the forwarder and read by the application
+static Result from_forwarder(const Options &o) {
+    const enum comm_link fwd = static_cast<enum comm_link>(-1 - uplink);
+    clear_links();
+    set_gw_send_hwm(uplink, 64 * sizeof(Message));
+    struct timeval tv = to_timeval(1000us);
+    set_gw_send_timeout(uplink, &tv);
+
+    Result r = run_mpmc(o,
+        [fwd](const Message &msg, unsigned) {
+            return send_to(fwd, &msg, sizeof(msg), -1, nullptr);
+        },
+        [](Message &msg, unsigned i) {
+            struct timeval tv = to_timeval(edge_timeouts[i % 4]);
+            return recv_from(uplink, &msg, sizeof(msg), &tv);
+        });
+
+    clear_links();
+    return r;
+}
+
+// Packets written by the application and read by the forwarder
+static Result to_forwarder(const Options &o) {
+    const enum comm_link fwd = static_cast<enum comm_link>(-1 - downlink);
+    clear_links();
+    struct timeval recv_tv = to_timeval(50us);
+    set_gw_recv_timeout(downlink, &recv_tv);
+
+    Result r = run_mpmc(o,
+        [](const Message &msg, unsigned i) {
+            struct timeval tv = to_timeval(edge_timeouts[i % 4]);
+            return send_to(downlink, &msg, sizeof(msg),
+                           64 * sizeof(Message), &tv);
+        },
+        [fwd](Message &msg, unsigned) {
+            return recv_from(fwd, &msg, sizeof(msg), nullptr);
+        });
+
+    clear_links();
+    return r;
+}
+
+// The addon's own queue, as used by the link readers
+static Result addon_queue(const Options &o) {
+    PacketQueue q;
+
+    return run_mpmc(o,
+        [&q](const Message &msg, unsigned i) {
+            auto bytes = reinterpret_cast<const uint8_t*>(&msg);
+            return q.send(std::make_shared<const std::vector<uint8_t>>(
+                              bytes, &bytes[sizeof(msg)]),
+                          64 * sizeof(Message), edge_timeouts[i % 4]);
+        },
+        [&q](Message &msg, unsigned i) {
+            return q.recv(&msg, sizeof(msg), edge_timeouts[i % 4]);
+        });
+}
+
+// Many calls timing out together on an empty queue of the addon's, where the
+// deadlines are kept by the shared timer wheel. Checks none returns early;
+// latency is how late each timeout was reported. Deadlines are rounded up to
+// the wheel's 100us tick, and the calls fall into step with it, so expect p50
+// around 100us. Before the wheel, when each call did its own timed wait, the
+// same run on a 1 CPU host gave about 46k msg/s with p50 57us and p99 375us
+// late; with the wheel it gives about 45k msg/s with p50 105us and p99
+// 210-440us.
+static Result timeouts(const Options &o) {
+    PacketQueue q;
+    const unsigned waiters = 64 * o.consumers;
+    std::vector<Consumed> consumed(waiters);
+
+    auto began = clock_type::now();
+    auto deadline = began + o.duration;
+
+    std::vector<std::thread> threads;
+    for (unsigned w = 0; w < waiters; ++w) {
+        threads.emplace_back([&, w] {
+            auto &mine = consumed[w];
+            for (unsigned i = 0; clock_type::now() < deadline; ++i) {
+                std::chrono::microseconds timeout(1000 * (1 + (w + i) % 10));
+                Message msg;
+                int64_t called = now_ns();
+                ssize_t r = q.recv(&msg, sizeof(msg), timeout);
+                int64_t late = now_ns() - called - timeout.count() * 1000;
+                if ((r >= 0) || (errno != EAGAIN) || (late < 0)) {
+                    ++mine.errors;
+                    return;
+                }
+                mine.latencies_ns.push_back(late);
+            }
+        });
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    Result r;
+    r.seconds = std::chrono::duration<double>(clock_type::now() - began).count();
+    verify(r, consumed, std::vector<std::vector<uint64_t>>(), true);
+    r.sent = r.received = r.latencies_ns.size();
+    return r;
+}
+
+// The addon's queue for the forwarder's informational messages
+static LogQueue log_queue(budget_log_info);
+
+static ssize_t log_message(const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    ssize_t r = log_queue.write(format, ap);
+    va_end(ap);
+    return r;
+}
+
+// Log messages are written until the queue is closed once it's drained.
+// Writes racing the close either fail with EBADF or are read before readers
+// see EBADF, so nothing accepted is lost. Repeated, resetting in between.
+static Result log_close_pending(const Options &o) {
+    const unsigned cycles = 10;
+    std::vector<std::vector<uint64_t>> sent(cycles, std::vector<uint64_t>(o.producers));
+    std::vector<Consumed> consumed(o.consumers);
+    std::atomic<uint64_t> errors{0};
+
+    log_queue.close(true);
+    log_queue.set_write_hwm(64 * 64);
+    log_queue.set_write_timeout(1000us);
+
+    auto began = clock_type::now();
+
+    for (uint32_t cycle = 0; cycle < cycles; ++cycle) {
+        log_queue.reset();
+        std::atomic<bool> closing{false};
+
+        std::vector<std::thread> readers;
+        for (unsigned c = 0; c < o.consumers; ++c) {
+            readers.emplace_back([&, c] {
+                char buf[64];
+                for (unsigned i = 0; ; ++i) {
+                    ssize_t n = log_queue.recv(buf, sizeof(buf) - 1,
+                                               edge_timeouts[i % 4]);
+                    if (n < 0) {
+                        if (errno == EBADF) {
+                            return;
+                        }
+                        if (errno != EAGAIN) {
+                            ++consumed[c].errors;
+                            return;
+                        }
+                        continue;
+                    }
+                    buf[n] = '\0';
+                    Message msg;
+                    unsigned long long seq;
+                    long long sent_ns;
+                    if (sscanf(buf, "%u %u %llu %lld", &msg.producer, &msg.cycle,
+                               &seq, &sent_ns) != 4) {
+                        ++consumed[c].errors;
+                        continue;
+                    }
+                    msg.seq = seq;
+                    msg.sent_ns = sent_ns;
+                    record(consumed[c], msg);
+                }
+            });
+        }
+
+        std::vector<std::thread> writers;
+        for (unsigned p = 0; p < o.producers; ++p) {
+            writers.emplace_back([&, p, cycle] {
+                uint64_t seq = 0;
+                while (!closing) {
+                    ssize_t r = log_message("%u %u %llu %lld", p, cycle,
+                                            static_cast<unsigned long long>(seq),
+                                            static_cast<long long>(now_ns()));
+                    if (r > 0) {
+                        ++seq;
+                    } else if ((r < 0) && (errno == EBADF)) {
+                        break;
+                    } else if ((r == 0) || (errno != EAGAIN)) {
+                        ++errors;
+                        break;
+                    }
+                }
+                sent[cycle][p] = seq;
+            });
+        }
+
+        std::this_thread::sleep_for(o.duration / cycles);
+        closing = true;
+        log_queue.close(false);
+
+        for (auto &t : writers) {
+            t.join();
+        }
+        for (auto &t : readers) {
+            t.join();
+        }
+    }
+
+    log_queue.reset();
+
+    Result r;
+    r.seconds = std::chrono::duration<double>(clock_type::now() - began).count();
+    verify(r, consumed, sent, false);
+    r.errors += errors;
+    return r;
+}
+
+// Producers and consumers keep going while the forwarder is repeatedly
+// started and stopped, which closes and then resets the link queues under
+// them. Messages queued at a close are discarded so loss is expected, but
+// calls may only fail with EAGAIN or EBADF and nothing may be duplicated.
+static Result close_reset(const Options &o) {
+    const enum comm_link fwd = static_cast<enum comm_link>(-1 - uplink);
+    std::vector<std::vector<uint64_t>> sent(1, std::vector<uint64_t>(o.producers));
+    std::vector<Consumed> consumed(o.consumers);
+    std::atomic<bool> done{false};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<unsigned> restarts{0};
+
+    clear_links();
+    auto began = clock_type::now();
+
+    std::vector<std::thread> threads;
+    for (unsigned c = 0; c < o.consumers; ++c) {
+        threads.emplace_back([&, c] {
+            for (unsigned i = 0; !done; ++i) {
+                Message msg;
+                struct timeval tv = to_timeval(edge_timeouts[i % 4]);
+                ssize_t n = recv_from(uplink, &msg, sizeof(msg), &tv);
+                if (n == static_cast<ssize_t>(sizeof(msg))) {
+                    record(consumed[c], msg);
+                } else if ((n >= 0) || ((errno != EAGAIN) && (errno != EBADF))) {
+                    ++consumed[c].errors;
+                }
+            }
+        });
+    }
+
+    for (unsigned p = 0; p < o.producers; ++p) {
+        threads.emplace_back([&, p] {
+            Message msg = { p, 0, 0, 0 };
+            while (!done) {
+                msg.sent_ns = now_ns();
+                ssize_t n = send_to(fwd, &msg, sizeof(msg), -1, nullptr);
+                if (n == static_cast<ssize_t>(sizeof(msg))) {
+                    ++msg.seq;
+                } else if ((n >= 0) || ((errno != EAGAIN) && (errno != EBADF))) {
+                    ++errors;
+                }
+            }
+            sent[0][p] = msg.seq;
+        });
+    }
+
+    auto deadline = began + o.duration;
+    while (clock_type::now() < deadline) {
+        std::thread forwarder([] { start("stress"); });
+        std::this_thread::sleep_for(1ms * (restarts % 5));
+        stop();
+        forwarder.join();
+        reset();
+        ++restarts;
+    }
+
+    done = true;
+    for (auto &t : threads) {
+        t.join();
+    }
+    clear_links();
+
+    Result r;
+    r.seconds = std::chrono::duration<double>(clock_type::now() - began).count();
+    verify(r, consumed, sent, true);
+    r.errors += errors;
+    // Unbounded queues emptied at random times, so latency isn't meaningful
+    r.latencies_ns.clear();
+    return r;
+}
+
+static const std::map<std::string, std::function<Result(const Options&)>> scenarios = {
+    { "from_forwarder", from_forwarder },
+    { "to_forwarder", to_forwarder },
+    { "addon_queue", addon_queue },
+    { "log_close_pending", log_close_pending },
+    { "close_reset", close_reset },
+    { "timeouts", timeouts }
+};
+
+struct Baseline {
+    double throughput = 0;
+    double p99_us = 0;
+};
+
+// Baselines are a JSON object keyed by scenario, each with throughput
+// (messages per second) and, for scenarios which measure latency, p99_us
+// members.
+static std::map<std::string, Baseline> read_baselines(const std::string &path) {
+    std::map<std::string, Baseline> r;
+    std::ifstream f(path);
+    if (!f) {
+        return r;
+    }
+
+    std::stringstream ss;
+    ss << f.rdbuf();
+    std::string s = ss.str();
+
+    gwmp::json::members(s, 0, [&](const gwmp::json::Span &k,
+                                  const gwmp::json::Span &v) {
+        std::string obj = s.substr(v.start, v.end - v.start);
+        Baseline b;
+        gwmp::json::get_number(obj, "throughput", b.throughput);
+        gwmp::json::get_number(obj, "p99_us", b.p99_us);
+        r[s.substr(k.start, k.end - k.start)] = b;
+    });
+
+    return r;
+}
+
+static void write_baselines(const std::string &path,
+                            const std::map<std::string, Baseline> &baselines) {
+    std::ofstream f(path);
+    f << "{\n";
+    size_t i = 0;
+    for (auto &b : baselines) {
+        f << "    \"" << b.first << "\": { \"throughput\": "
+          << static_cast<uint64_t>(b.second.throughput);
+        if (b.second.p99_us > 0) {
+            f << ", \"p99_us\": " << static_cast<uint64_t>(b.second.p99_us);
+        }
+        f << " }" << (++i < baselines.size() ? "," : "") << "\n";
+    }
+    f << "}\n";
+}
+
+static void print_result(const std::string &name, const Result &r) {
+    printf("%-18s sent %9llu received %9llu %10.0f msg/s ",
+           name.c_str(),
+           static_cast<unsigned long long>(r.sent),
+           static_cast<unsigned long long>(r.received),
+           r.throughput());
+    if (r.latencies_ns.empty()) {
+        printf("latency not measured\n");
+    } else {
+        printf("p50 %8.1fus p99 %8.1fus p99.9 %8.1fus max %8.1fus\n",
+               r.percentile_us(0.5), r.percentile_us(0.99),
+               r.percentile_us(0.999), r.percentile_us(1));
+    }
+}
+
+// Returns how the result is worse than the baseline, or an empty string
+static std::string regression(const Result &r, const Baseline &b, const Options &o) {
+    char buf[128];
+    if (r.throughput() < b.throughput * (1 - o.tolerance)) {
+        snprintf(buf, sizeof(buf), "throughput %.0f msg/s, baseline %.0f msg/s",
+                 r.throughput(), b.throughput);
+        return buf;
+    }
+    if (o.check_latency && (b.p99_us > 0) &&
+        (r.percentile_us(0.99) > b.p99_us * (1 + o.latency_tolerance))) {
+        snprintf(buf, sizeof(buf), "p99 %.1fus, baseline %.1fus",
+                 r.percentile_us(0.99), b.p99_us);
+        return buf;
+    }
+    return std::string();
+}
+
+static void usage(const char *argv0) {
+    std::cerr << "usage: " << argv0 << " [options]\n"
+              << "  -p, --producers N      producer threads per scenario (default 4)\n"
+              << "  -c, --consumers N      consumer threads per scenario (default 4)\n"
+              << "  -d, --duration MS      how long to run each scenario (default 1000)\n"
+              << "  -s, --scenario NAME    run only this scenario (repeatable)\n"
+              << "  -b, --baseline FILE    compare against baselines in FILE\n"
+              << "  -u, --update-baseline  write the results to the baseline file\n"
+              << "  -n, --no-latency       don't compare p99 latency against the baselines\n"
+              << "  -t, --tolerance F      allowed throughput drop as a fraction (default 0.5)\n"
+              << "  -L, --latency-tolerance F\n"
+              << "                         allowed p99 rise as a fraction (default 4, i.e. 5x)\n"
+              << "  -r, --retries N        run a regressed scenario again up to N times (default 2)\n"
+              << "scenarios:";
+    for (auto &s : scenarios) {
+        std::cerr << " " << s.first;
+    }
+    std::cerr << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    Options o;
+
+    static const struct option long_options[] = {
+        { "producers", required_argument, nullptr, 'p' },
+        { "consumers", required_argument, nullptr, 'c' },
+        { "duration", required_argument, nullptr, 'd' },
+        { "scenario", required_argument, nullptr, 's' },
+        { "baseline", required_argument, nullptr, 'b' },
+        { "update-baseline", no_argument, nullptr, 'u' },
+        { "no-latency", no_argument, nullptr, 'n' },
+        { "tolerance", required_argument, nullptr, 't' },
+        { "latency-tolerance", required_argument, nullptr, 'L' },
+        { "retries", required_argument, nullptr, 'r' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:c:d:s:b:unt:L:r:h",
+                              long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'p':
+            o.producers = std::max(1, atoi(optarg));
+            break;
+        case 'c':
+            o.consumers = std::max(1, atoi(optarg));
+            break;
+        case 'd':
+            o.duration = std::chrono::milliseconds(std::max(1, atoi(optarg)));
+            break;
+        case 's':
+            if (scenarios.find(optarg) == scenarios.end()) {
+                usage(argv[0]);
+                return 1;
+            }
+            o.scenarios.push_back(optarg);
+            break;
+        case 'b':
+            o.baseline = optarg;
+            break;
+        case 'u':
+            o.update_baseline = true;
+            break;
+        case 'n':
+            o.check_latency = false;
+            break;
+        case 't':
+            o.tolerance = atof(optarg);
+            break;
+        case 'L':
+            o.latency_tolerance = atof(optarg);
+            break;
+        case 'r':
+            o.retries = std::max(0, atoi(optarg));
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (o.scenarios.empty()) {
+        for (auto &s : scenarios) {
+            o.scenarios.push_back(s.first);
+        }
+    }
+
+    auto baselines = read_baselines(o.baseline);
+    auto updated = baselines;
+    bool failed = false;
+
+    for (auto &name : o.scenarios) {
+        auto it = baselines.find(name);
+        const bool compare = !o.update_baseline && (it != baselines.end());
+
+        // A regression has to show in every attempt, so a run disturbed by
+        // something else on the host doesn't fail on its own
+        for (unsigned attempt = 0; ; ++attempt) {
+            Result r;
+            {
+                Watchdog watchdog(name, o.duration * 2 + 10s);
+                r = scenarios.at(name)(o);
+            }
+            updated[name].throughput = r.throughput();
+            updated[name].p99_us = r.latencies_ns.empty() ? 0 : r.percentile_us(0.99) + 1;
+            print_result(name, r);
+
+            if (!r.ok()) {
+                printf("%-18s FAILED: lost %llu duplicated %llu unexpected %llu errors %llu\n",
+                       name.c_str(),
+                       static_cast<unsigned long long>(r.lost),
+                       static_cast<unsigned long long>(r.duplicated),
+                       static_cast<unsigned long long>(r.unexpected),
+                       static_cast<unsigned long long>(r.errors));
+                failed = true;
+                break;
+            }
+
+            if (!compare) {
+                break;
+            }
+
+            std::string why = regression(r, it->second, o);
+            if (why.empty()) {
+                break;
+            }
+            if (attempt == o.retries) {
+                printf("%-18s REGRESSED: %s\n", name.c_str(), why.c_str());
+                failed = true;
+                break;
+            }
+            printf("%-18s %s, running again\n", name.c_str(), why.c_str());
+        }
+    }
+
+    if (o.update_baseline && !failed && !o.baseline.empty()) {
+        // scenarios which weren't run keep their old baselines
+        write_baselines(o.baseline, updated);
+    }
+
+    return failed ? 1 : 0;
+}
@@ -6,11 +6,15 @@ const lora_comms = require('..'),
       LoRaComms = require('bindings')('lora_comms').LoRaComms,
       lora_packet = require('lora-packet'),
       crypto = require('crypto'),
+      dgram = require('dgram'),
+      fs = require('fs'),
+      path = require('path'),
       { EventEmitter } = require('events'),
       { Transform, PassThrough } = require('stream'),
       aw = require('awaitify-stream'),
       expect = require('chai').expect,
       argv = require('yargs').argv,
+      { push_data } = require('./fixtures/gwmp'),
       PROTOCOL_VERSION = 2,
       pkts = {
           PUSH_DATA: 0,
@@ -258,6 +262,54 @@ function wait_for_logs(cb)
 afterEach(stop);
 afterEach(wait_for_logs);
 
+// Tests which inject packets as the forwarder need the simulator
+function skip_unless_simulating()
+{
+    if (!argv.simulate)
+    {
+        this.skip();
+    }
+}
+
+const fwd_uplink = -1 - LoRaComms.uplink;
+
+function send(link, data)
+{
+    return new Promise((resolve, reject) =>
+    {
+        LoRaComms.send_to(link, data, -1, -1, -1, (err, r) =>
+        {
+            if (err) { return reject(err); }
+            resolve(r);
+        });
+    });
+}
+
+function recv(link, s = -1, us = -1)
+{
+    return new Promise((resolve, reject) =>
+    {
+        const buf = Buffer.alloc(LoRaComms.recv_from_buflen);
+        LoRaComms.recv_from(link, buf, s, us, (err, r) =>
+        {
+            if (err) { return reject(err); }
+            resolve(buf.slice(0, r));
+        });
+    });
+}
+
+// Base64 PHYPayload of a data frame from DevAddr
+function frame(FCnt, key, MType = 'Unconfirmed Data Up')
+{
+    return lora_packet.fromFields({
+        MType,
+        DevAddr,
+        FPort: 1,
+        payload: Buffer.alloc(payload_size),
+        FCnt
+    }, AppSKey, key || NwkSKey).getPHYPayload().toString('base64');
+}
+
 describe('echoing device', function ()
 {
     this.timeout(60 * 60 * 1000);
@@ -477,6 +529,23 @@ describe('logging', function ()
         expect(lora_comms.downlink).not.to.be.undefined;
         lora_comms.stop_logging();
     });
+
+    it("should read the forwarder's messages", function (cb)
+    {
+        if (!argv.simulate)
+        {
+            return this.skip();
+        }
+
+        lora_comms.start_logging();
+        lora_comms.log_info.once('data', data =>
+        {
+            expect(data.toString()).to.equal('Waiting for stop\n');
+            lora_comms.log_info.resume();
+            cb();
+        });
+        lora_comms.start({ no_streams: true });
+    });
 });
 
 describe('multiple calls', function ()
@@ -560,3 +629,762 @@ describe('timeout', function ()
         });
     });
 });
+
+describe('dedup', function ()
+{
+    before(skip_unless_simulating);
+
+    it('should suppress duplicate frames', async function ()
+    {
+        start({ no_streams: true, dedup: { window: 60000 } });
+
+        await send(fwd_uplink, push_data({ rxpk: [{ rssi: -100, lsnr: 5, data: frame(0) }] }));
+        let rxpk = JSON.parse((await recv(LoRaComms.uplink, -1, -1)).slice(12)).rxpk;
+        expect(rxpk.length).to.equal(1);
+        expect(rxpk[0].data).to.equal(frame(0));
+
+        await send(fwd_uplink, push_data({ rxpk: [{ rssi: -90, lsnr: 7, data: frame(0) },
+                                                  { rssi: -80, lsnr: 3, data: frame(1) }] }));
+        rxpk = JSON.parse((await recv(LoRaComms.uplink, -1, -1)).slice(12)).rxpk;
+        expect(rxpk.length).to.equal(1);
+        expect(rxpk[0].data).to.equal(frame(1));
+        expect(rxpk[0].rssi).to.equal(-80);
+
+        const dup = push_data({ rxpk: [{ data: frame(1) }] });
+        await send(fwd_uplink, dup);
+        const ack = await recv(fwd_uplink, -1, -1);
+        expect(ack.equals(Buffer.from([PROTOCOL_VERSION, dup[1], dup[2], pkts.PUSH_ACK]))).to.be.true;
+
+        expect(lora_comms.dedup_stats).to.eql({
+            frames: 4,
+            duplicates: 2,
+            evictions: 0,
+            held: 0
+        });
+    });
+
+    it('should merge duplicate frames', async function ()
+    {
+        start({ no_streams: true, dedup: { window: 100, merge: true } });
+
+        for (let [rssi, lsnr] of [[-100, 7], [-90, 5]])
+        {
+            const data = push_data({ rxpk: [{ rssi, lsnr, data: frame(0) }] });
+            await send(fwd_uplink, data);
+            const ack = await recv(fwd_uplink, -1, -1);
+            expect(ack.equals(Buffer.from([PROTOCOL_VERSION, data[1], data[2], pkts.PUSH_ACK]))).to.be.true;
+        }
+
+        const merged = await recv(LoRaComms.uplink, -1, -1);
+        expect(merged[0]).to.equal(PROTOCOL_VERSION);
+        expect(merged[3]).to.equal(pkts.PUSH_DATA);
+        expect(JSON.parse(merged.slice(12)).rxpk).to.eql([{
+            rssi: -90,
+            lsnr: 7,
+            data: frame(0),
+            rcnt: 2
+        }]);
+
+        // Acknowledgement of the merged packet shouldn't reach the forwarder
+        await send(LoRaComms.uplink, Buffer.from([PROTOCOL_VERSION, merged[1], merged[2], pkts.PUSH_ACK]));
+        LoRaComms.set_gw_recv_timeout(LoRaComms.uplink, 0, 0);
+        try
+        {
+            await recv(fwd_uplink, 0, 0);
+            throw new Error('should have failed');
+        }
+        catch (ex)
+        {
+            expect(ex.errno).to.equal(LoRaComms.EAGAIN);
+        }
+        finally
+        {
+            LoRaComms.set_gw_recv_timeout(LoRaComms.uplink, -1, -1);
+        }
+    });
+
+    it('should merge frames whose entries were evicted', async function ()
+    {
+        // Each new frame evicts the last one's entry
+        start({ no_streams: true, dedup: { capacity: 1, window: 100, merge: true } });
+
+        for (let [rssi, lsnr, FCnt] of [[-100, 7, 0], [-80, 3, 1], [-90, 5, 0]])
+        {
+            await send(fwd_uplink, push_data({ rxpk: [{ rssi, lsnr, data: frame(FCnt) }] }));
+            await recv(fwd_uplink, -1, -1);
+        }
+
+        const merged = await recv(LoRaComms.uplink, -1, -1);
+        expect(JSON.parse(merged.slice(12)).rxpk).to.eql([{
+            rssi: -90,
+            lsnr: 7,
+            data: frame(0),
+            rcnt: 2
+        }, {
+            rssi: -80,
+            lsnr: 3,
+            data: frame(1),
+            rcnt: 1
+        }]);
+        expect(lora_comms.dedup_stats).to.eql({
+            frames: 3,
+            duplicates: 1,
+            evictions: 2,
+            held: 0
+        });
+    });
+
+    it('should deliver held frames when stopped', async function ()
+    {
+        start({ no_streams: true, dedup: { window: 60000, merge: true } });
+
+        const data = push_data({ rxpk: [{ rssi: -100, data: frame(0) }] });
+        await send(fwd_uplink, data);
+        await recv(fwd_uplink, -1, -1);
+        expect(lora_comms.dedup_stats.held).to.equal(1);
+
+        lora_comms.stop();
+
+        const merged = await recv(LoRaComms.uplink, -1, -1);
+        expect(JSON.parse(merged.slice(12)).rxpk).to.eql([{
+            rssi: -100,
+            data: frame(0),
+            rcnt: 1
+        }]);
+        // the forwarder's token isn't reused
+        expect(merged.slice(1, 3).equals(data.slice(1, 3))).to.be.false;
+    });
+
+    it('should reject zero capacity', function ()
+    {
+        expect(() => lora_comms.start({ no_streams: true, dedup: { capacity: 0 } })).to.throw('invalid dedup.capacity: 0');
+    });
+});
+
+describe('broadcast', function ()
+{
+    before(skip_unless_simulating);
+
+    async function send_packets(n)
+    {
+        const sent = [];
+        for (let i = 0; i < n; ++i)
+        {
+            sent.push(crypto.randomBytes(16));
+            await send(fwd_uplink, sent[i]);
+            // packets are published to subscribers before they can be read
+            // from the link
+            expect((await recv(LoRaComms.uplink)).equals(sent[i])).to.be.true;
+        }
+        return sent;
+    }
+
+    it('should deliver packets to every subscriber', async function ()
+    {
+        start({ no_streams: true, broadcast: true });
+
+        const subs = [lora_comms.subscribe('uplink'),
+                      lora_comms.subscribe('uplink', { policy: 'block' })];
+        const sent = await send_packets(5);
+
+        for (let sub of subs)
+        {
+            const sub_in = aw.createReader(sub);
+            for (let data of sent)
+            {
+                expect((await sub_in.readAsync()).equals(data)).to.be.true;
+            }
+            expect(sub.stats).to.eql({
+                received: 5,
+                dropped: 0,
+                lag: 0,
+                max_lag: sub.stats.max_lag,
+                disconnected: false
+            });
+            sub.destroy();
+        }
+    });
+
+    it('should drop packets for slow subscribers', async function ()
+    {
+        start({ no_streams: true, broadcast: { capacity: 4 } });
+
+        const sub = lora_comms.subscribe('uplink', { highWaterMark: 1 });
+        await send_packets(10);
+
+        const stats = sub.stats;
+        expect(stats.dropped).to.be.above(0);
+        expect(stats.received + stats.dropped + stats.lag).to.equal(10);
+        sub.destroy();
+    });
+
+    it('should disconnect slow subscribers', function (cb)
+    {
+        start({ no_streams: true, broadcast: { capacity: 4 } });
+
+        const sub = lora_comms.subscribe('uplink', {
+            policy: 'disconnect',
+            highWaterMark: 1
+        });
+        sub.on('error', function (err)
+        {
+            expect(err.errno).to.equal(LoRaComms.ECONNRESET);
+            expect(sub.stats.disconnected).to.be.true;
+            sub.destroy();
+            cb();
+        });
+        send_packets(10);
+    });
+
+    it('should bound the link queue when only subscribers read', async function ()
+    {
+        start({ no_streams: true, broadcast: { capacity: 4 } });
+
+        const sub_in = aw.createReader(lora_comms.subscribe('uplink'));
+        for (let i = 0; i < 10; ++i)
+        {
+            const data = crypto.randomBytes(16);
+            await send(fwd_uplink, data);
+            expect((await sub_in.readAsync()).equals(data)).to.be.true;
+        }
+
+        const stats = lora_comms.queue_stats.uplink;
+        expect(stats.packets).to.equal(4);
+        expect(stats.dropped).to.equal(6);
+    });
+
+    it('should reject an unknown policy', function ()
+    {
+        start({ no_streams: true, broadcast: true });
+        expect(() => lora_comms.subscribe('uplink', { policy: 'wait' })).to.throw('invalid policy: wait');
+        expect(() => lora_comms.subscribe('sidelink')).to.throw('invalid link: sidelink');
+    });
+});
+
+describe('memory budget', function ()
+{
+    before(skip_unless_simulating);
+
+    afterEach(function ()
+    {
+        lora_comms.set_memory_budget(0);
+    });
+
+    it('should drop packets which exceed the budget', async function ()
+    {
+        lora_comms.set_memory_budget(1000);
+        start({ no_streams: true });
+
+        let usage = lora_comms.memory_usage;
+        expect(usage.budget).to.equal(1000);
+        expect(usage.uplink.limit).to.equal(500);
+        expect(usage.log_info.priority).to.be.below(usage.log_error.priority);
+
+        const sent = [];
+        for (let i = 0; i < 10; ++i)
+        {
+            sent.push(crypto.randomBytes(100));
+            await send(fwd_uplink, sent[i]);
+        }
+
+        while (lora_comms.memory_usage.uplink.dropped < 5)
+        {
+            await new Promise(resolve => setTimeout(resolve, 10));
+        }
+
+        usage = lora_comms.memory_usage;
+        expect(usage.uplink.used).to.equal(500);
+        expect(usage.uplink.dropped).to.equal(5);
+
+        for (let i = 0; i < 5; ++i)
+        {
+            expect((await recv(LoRaComms.uplink)).equals(sent[i])).to.be.true;
+        }
+
+        expect(lora_comms.memory_usage.uplink.used).to.equal(0);
+    });
+
+    it('should let a packet through however small the share', async function ()
+    {
+        lora_comms.set_memory_budget(1000, { shares: { uplink: 0.0001 } });
+        start({ no_streams: true });
+
+        const data = crypto.randomBytes(100);
+        expect(await send(LoRaComms.uplink, data)).to.equal(data.length);
+        expect((await recv(fwd_uplink)).equals(data)).to.be.true;
+    });
+
+    it('should reject invalid shares', function ()
+    {
+        expect(() => lora_comms.set_memory_budget(1000, { shares: { downlink: 0 } })).to.throw('invalid downlink share: 0');
+        expect(() => lora_comms.set_memory_budget(-1)).to.throw('invalid budget: -1');
+    });
+});
+
+describe('thread options', function ()
+{
+    before(skip_unless_simulating);
+
+    it('should report effective thread settings', async function ()
+    {
+        start({
+            no_streams: true,
+            dedup: true,
+            forwarder_thread: { cpus: [0] },
+            reader_thread: { cpus: [0] }
+        });
+
+        let settings;
+        while (true)
+        {
+            settings = lora_comms.thread_settings;
+            if (settings.forwarder && settings.uplink_reader)
+            {
+                break;
+            }
+            await new Promise(resolve => setTimeout(resolve, 10));
+        }
+
+        for (let thread of [settings.forwarder, settings.uplink_reader])
+        {
+            expect(thread.cpus).to.eql([0]);
+            expect(thread.policy).to.equal('other');
+            expect(thread.affinity_error).to.equal(null);
+            expect(thread.sched_error).to.equal(null);
+        }
+        expect(settings.memory_locked).to.be.false;
+    });
+});
+
+describe('bridge', function ()
+{
+    before(skip_unless_simulating);
+
+    it('should exchange packets with a network server', async function ()
+    {
+        const server = dgram.createSocket('udp4');
+        await new Promise(resolve => server.bind(0, '127.0.0.1', resolve));
+        const port = server.address().port;
+
+        start({
+            no_streams: true,
+            bridge: {
+                address: '127.0.0.1',
+                uplink_port: port,
+                downlink_port: port
+            }
+        });
+
+        const received = new Promise(resolve => server.once('message',
+            (msg, rinfo) => resolve({ msg, rinfo })));
+
+        const data = push_data({ rxpk: [] });
+        await send(fwd_uplink, data);
+
+        const { msg, rinfo } = await received;
+        expect(msg.equals(data)).to.be.true;
+
+        const push_ack = Buffer.from([PROTOCOL_VERSION, data[1], data[2], pkts.PUSH_ACK]);
+        server.send(push_ack, rinfo.port, rinfo.address);
+        expect((await recv(fwd_uplink)).equals(push_ack)).to.be.true;
+
+        let err;
+        try
+        {
+            await recv(LoRaComms.uplink);
+        }
+        catch (ex)
+        {
+            err = ex;
+        }
+        expect(err.errno).to.equal(LoRaComms.EBADF);
+
+        const stats = lora_comms.bridge_stats.uplink;
+        expect(stats.sent).to.equal(1);
+        expect(stats.received).to.equal(1);
+        expect(stats.send_errors).to.equal(0);
+
+        server.close();
+    });
+
+    it('should reject addresses which are not numeric', function ()
+    {
+        expect(() => lora_comms.start({
+            no_streams: true,
+            bridge: { address: 'foo' }
+        })).to.throw(Error);
+        expect(lora_comms.active).to.be.false;
+    });
+});
+
+describe('reconfiguration', function ()
+{
+    before(skip_unless_simulating);
+
+    function config_dirs()
+    {
+        return fs.readdirSync('/dev/shm').filter(f => f.startsWith('lora-comms-'));
+    }
+
+    it('should start with in-memory configuration', async function ()
+    {
+        const before = config_dirs();
+        const config = { gateway_conf: { gateway_ID: 'AA555A0000000000' } };
+        start({ no_streams: true, config });
+
+        const dirs = config_dirs().filter(f => before.indexOf(f) < 0);
+        expect(dirs.length).to.equal(1);
+        expect(JSON.parse(fs.readFileSync(
+            path.join('/dev/shm', dirs[0], 'global_conf.json')))).to.eql(config);
+
+        const data = crypto.randomBytes(16);
+        await send(fwd_uplink, data);
+        expect((await recv(LoRaComms.uplink)).equals(data)).to.be.true;
+
+        const latency = lora_comms.startup_latency;
+        expect(latency.forwarder).to.be.at.least(0);
+        expect(latency.first_packet).to.be.at.least(latency.forwarder);
+
+        await new Promise(resolve =>
+        {
+            lora_comms.once('stop', resolve);
+            lora_comms.stop();
+        });
+        expect(config_dirs()).to.eql(before);
+    });
+
+    it('should apply settings while running', async function ()
+    {
+        start({ no_streams: true, dedup: true });
+
+        expect(() => lora_comms.reconfigure({
+            log: { write_hwm: 100 },
+            uplink: { recv_timeout: 0 }
+        })).to.throw('uplink.recv_timeout can\'t be changed while the radio is on');
+
+        expect(() => lora_comms.reconfigure({
+            log: { write_hwm: 100, max_msg_size: 0 }
+        })).to.throw('invalid log.max_msg_size: 0');
+
+        lora_comms.reconfigure({
+            log: { write_timeout: 1000 },
+            dedup: { capacity: 4096, window: 500 }
+        });
+
+        const data = crypto.randomBytes(16);
+        expect(await send(fwd_uplink, data)).to.equal(data.length);
+        expect((await recv(LoRaComms.uplink)).equals(data)).to.be.true;
+    });
+
+    it('should apply link limits while the addon reads the link', async function ()
+    {
+        start({ no_streams: true, dedup: true });
+
+        lora_comms.reconfigure({ uplink: { send_hwm: 0 } });
+        const data = crypto.randomBytes(16);
+        expect(await send(fwd_uplink, data)).to.equal(data.length);
+        while (lora_comms.queue_stats.uplink.dropped < 1)
+        {
+            await new Promise(resolve => setTimeout(resolve, 10));
+        }
+
+        lora_comms.reconfigure({ uplink: { send_hwm: -1 } });
+        expect(await send(fwd_uplink, data)).to.equal(data.length);
+        expect((await recv(LoRaComms.uplink)).equals(data)).to.be.true;
+        expect(lora_comms.queue_stats.uplink.dropped).to.equal(1);
+    });
+
+    it("should only apply link settings from the next start if the addon doesn't read the link", function ()
+    {
+        start({ no_streams: true });
+        expect(() => lora_comms.reconfigure({ downlink: { send_hwm: 0 } }))
+            .to.throw('downlink.send_hwm can\'t be changed while the radio is on');
+    });
+
+    it('should apply link settings from the next start', async function ()
+    {
+        lora_comms.reconfigure({ uplink: { send_hwm: 0 } });
+        start({ no_streams: true });
+
+        const data = crypto.randomBytes(16);
+        expect(await send(fwd_uplink, data)).to.equal(0);
+
+        await new Promise(resolve =>
+        {
+            lora_comms.once('stop', resolve);
+            lora_comms.stop();
+        });
+        lora_comms.reconfigure({ uplink: { send_hwm: -1 } });
+    });
+
+    it('should not enable dedup while running', function ()
+    {
+        start({ no_streams: true });
+        expect(() => lora_comms.reconfigure({ dedup: true }))
+            .to.throw('dedup was not enabled by start');
+    });
+});
+
+describe('phy', function ()
+{
+    before(skip_unless_simulating);
+
+    afterEach(function ()
+    {
+        lora_comms.clear_sessions();
+    });
+
+    it('should decode frames and verify MICs', async function ()
+    {
+        start({ no_streams: true, phy: true });
+        lora_comms.set_session(DevAddr, NwkSKey, 0xfff0);
+
+        const bad_key = Buffer.alloc(16, 1);
+        await send(fwd_uplink, push_data({ rxpk: [
+            { data: frame(0xfff5) },
+            { data: frame(0xfff6, bad_key) },
+            { data: frame(0xfff7, null, 'Unconfirmed Data Down') }
+        ] }));
+
+        const rxpk = JSON.parse((await recv(LoRaComms.uplink)).slice(12)).rxpk;
+        expect(rxpk.length).to.equal(3);
+        expect(rxpk[0].phy).to.eql({
+            mtype: 2,
+            major: 0,
+            dev_addr: DevAddr.toString('hex'),
+            adr: false,
+            adr_ack_req: false,
+            ack: false,
+            fpending: false,
+            fcnt: 0xfff5,
+            fopts: '',
+            fport: 1,
+            mic: 'ok'
+        });
+        expect(rxpk[1].phy.mic).to.equal('fail');
+        expect(rxpk[2].phy).to.eql({ mtype: 3, major: 0, mic: 'invalid' });
+
+        const stats = lora_comms.phy_stats;
+        expect(stats.ok).to.equal(1);
+        expect(stats.failed).to.equal(1);
+        expect(stats.invalid).to.equal(1);
+        expect(stats.sessions).to.equal(1);
+    });
+
+    it('should drop unauthenticated frames', async function ()
+    {
+        start({ no_streams: true, phy: { mode: 'drop' } });
+        lora_comms.set_session(DevAddr, NwkSKey);
+
+        await send(fwd_uplink, push_data({ rxpk: [
+            { data: frame(1, Buffer.alloc(16, 1)) },
+            { data: frame(2) },
+            { data: frame(3, null, 'Unconfirmed Data Down') }
+        ] }));
+
+        const rxpk = JSON.parse((await recv(LoRaComms.uplink)).slice(12)).rxpk;
+        expect(rxpk.length).to.equal(1);
+        expect(rxpk[0].phy.fcnt).to.equal(2);
+        expect(rxpk[0].phy.mic).to.equal('ok');
+
+        lora_comms.remove_session(DevAddr);
+        const data = push_data({ rxpk: [{ data: frame(4) }] });
+        await send(fwd_uplink, data);
+
+        const ack = await recv(fwd_uplink);
+        expect(ack.equals(Buffer.from([PROTOCOL_VERSION, data[1], data[2], pkts.PUSH_ACK]))).to.be.true;
+        expect(lora_comms.phy_stats.dropped).to.equal(3);
+    });
+});
+
+describe('binary format', function ()
+{
+    before(skip_unless_simulating);
+
+    it('should deliver a record per frame', async function ()
+    {
+        start({ no_streams: true, format: 'binary' });
+
+        const phy = Buffer.from(frame(1), 'base64');
+
+        const data = push_data({ rxpk: [{
+            time: '2013-03-31T16:21:17.528002Z',
+            tmst: 3512348611,
+            chan: 2,
+            rfch: 0,
+            freq: 866.349812,
+            stat: 1,
+            modu: 'LORA',
+            datr: 'SF7BW125',
+            codr: '4/6',
+            rssi: -35,
+            lsnr: 5.1,
+            size: phy.length,
+            data: phy.toString('base64')
+        }, {
+            tmst: 3512348514,
+            chan: 9,
+            rfch: 1,
+            freq: 869.1,
+            stat: -1,
+            modu: 'FSK',
+            datr: 50000,
+            rssi: -75,
+            size: 3,
+            data: 'AAEC'
+        }]});
+        await send(fwd_uplink, data);
+
+        const record = await recv(LoRaComms.uplink);
+        expect(record.length).to.equal(LoRaComms.record_header_size + phy.length);
+        expect(lora_comms.decode_uplink_record(record)).to.eql({
+            tmst: 3512348611,
+            time: new Date('2013-03-31T16:21:17.528Z'),
+            tmms: null,
+            freq: 866.349812,
+            chan: 2,
+            rfch: 0,
+            stat: 1,
+            modu: 'LORA',
+            datr: 'SF7BW125',
+            codr: '4/6',
+            rssi: -35,
+            lsnr: 5.1,
+            size: phy.length,
+            data: phy,
+            eui: 'aaaaaaaaaaaaaaaa',
+            rcnt: 1,
+            mic: null
+        });
+
+        const fsk = lora_comms.decode_uplink_record(await recv(LoRaComms.uplink));
+        expect(fsk.modu).to.equal('FSK');
+        expect(fsk.datr).to.equal(50000);
+        expect(fsk.stat).to.equal(-1);
+        expect(fsk.lsnr).to.equal(null);
+        expect(fsk.data.equals(Buffer.from([0, 1, 2]))).to.be.true;
+
+        const ack = await recv(fwd_uplink);
+        expect(ack.equals(Buffer.from([PROTOCOL_VERSION, data[1], data[2], pkts.PUSH_ACK]))).to.be.true;
+
+        const stat = push_data({ stat: { rxnb: 2 } });
+        await send(fwd_uplink, stat);
+        const packet = await recv(LoRaComms.uplink);
+        expect(lora_comms.decode_uplink_record(packet)).to.equal(null);
+        expect(packet.equals(stat)).to.be.true;
+
+        expect(lora_comms.format_stats).to.eql({ records: 2, invalid: 0 });
+    });
+
+    it('should count frames without valid data', async function ()
+    {
+        start({ no_streams: true, format: 'binary' });
+
+        const data = push_data({ rxpk: [{ rssi: -35 }, { data: '!!' }, { data: 'AAEC' }] });
+        await send(fwd_uplink, data);
+
+        const record = lora_comms.decode_uplink_record(await recv(LoRaComms.uplink));
+        expect(record.data.equals(Buffer.from([0, 1, 2]))).to.be.true;
+
+        const ack = await recv(fwd_uplink);
+        expect(ack.equals(Buffer.from([PROTOCOL_VERSION, data[1], data[2], pkts.PUSH_ACK]))).to.be.true;
+
+        expect(lora_comms.format_stats).to.eql({ records: 1, invalid: 2 });
+    });
+
+    it('should reject an unknown format', function ()
+    {
+        expect(() => lora_comms.start({ format: 'xml' })).to.throw('invalid format: xml');
+    });
+});
+
+describe('watermarks', function ()
+{
+    before(skip_unless_simulating);
+
+    afterEach(function ()
+    {
+        lora_comms.set_watermarks('uplink', null);
+    });
+
+    function packet()
+    {
+        const data = Buffer.alloc(40);
+        data[0] = PROTOCOL_VERSION;
+        data[3] = pkts.PULL_RESP;
+        return data;
+    }
+
+    it('should emit events when watermarks are crossed', async function ()
+    {
+        lora_comms.set_watermarks('uplink', { high_packets: 3, low_packets: 1 });
+        start({ no_streams: true });
+
+        const high = new Promise(resolve => lora_comms.once('high_watermark',
+            (queue, length) => resolve([queue, length])));
+        for (let i = 0; i < 3; ++i)
+        {
+            await send(fwd_uplink, packet());
+        }
+        expect(await high).to.eql(['uplink', { packets: 3, bytes: 120 }]);
+        expect(lora_comms.queue_stats.uplink.congested).to.be.true;
+
+        const low = new Promise(resolve => lora_comms.once('low_watermark',
+            (queue, length) => resolve([queue, length])));
+        await recv(LoRaComms.uplink);
+        await recv(LoRaComms.uplink);
+        expect(await low).to.eql(['uplink', { packets: 1, bytes: 40 }]);
+        expect(lora_comms.queue_stats.uplink.congested).to.be.false;
+    });
+
+    it('should drop packets over the adaptive high-water mark', async function ()
+    {
+        start({ no_streams: true, adaptive_hwm: { min: 64, max: 64 } });
+        expect(lora_comms.queue_stats.uplink.hwm).to.equal(64);
+
+        for (let i = 0; i < 5; ++i)
+        {
+            await send(fwd_uplink, packet());
+        }
+        while (lora_comms.queue_stats.uplink.dropped < 3)
+        {
+            await new Promise(resolve => setTimeout(resolve, 10));
+        }
+        expect(lora_comms.queue_stats.uplink.packets).to.equal(2);
+    });
+
+    it('should adapt the high-water mark to how fast packets are read', async function ()
+    {
+        start({ no_streams: true, adaptive_hwm: { latency: 100, min: 64, max: 4096 } });
+        expect(lora_comms.queue_stats.uplink.hwm).to.equal(4096);
+
+        // Reading one packet for every two sent lowers the bound to what
+        // can be read within the latency
+        while (lora_comms.queue_stats.uplink.hwm >= 1024)
+        {
+            await send(fwd_uplink, packet());
+            await send(fwd_uplink, packet());
+            await recv(LoRaComms.uplink);
+            await new Promise(resolve => setTimeout(resolve, 50));
+        }
+        expect(lora_comms.queue_stats.uplink.hwm).to.be.at.least(64);
+
+        for (let n = lora_comms.queue_stats.uplink.packets; n > 0; --n)
+        {
+            await recv(LoRaComms.uplink);
+        }
+
+        // Keeping up relaxes it back to the maximum
+        while (lora_comms.queue_stats.uplink.hwm < 4096)
+        {
+            await send(fwd_uplink, packet());
+            await recv(LoRaComms.uplink);
+            await new Promise(resolve => setTimeout(resolve, 20));
+        }
+    });
+
+    it('should reject an unknown queue', function ()
+    {
+        expect(() => lora_comms.set_watermarks('foo', {})).to.throw('invalid queue: foo');
+    });
+});
@@ -0,0 +1,261 @@
+// Unit test for the timer wheel which keeps the deadlines of timed calls on
+// the addon's own queues.
+//
+// Built alongside the stress harness (node-gyp rebuild --simulate=true). Each
+// check uses its own wheel; small ticks let the cascades between levels and
+// deadlines beyond the top level happen within a few seconds. A timer which
+// lands in the wrong slot is late by a whole turn of a level, so lateness is
+// checked against bounds well below that.
+//
+// Exit status is 0 on success and 1 if a check failed.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "timer_wheel.h"
+
+using namespace std::chrono_literals;
+typedef TimerWheel::clock clock_type;
+
+// Records when it expired
+class Stamp : public TimerWheel::Timer {
+public:
+    void expire() override {
+        expired_at = clock_type::now();
+        expired = true;
+    }
+
+    clock_type::time_point added_at;
+    std::chrono::microseconds timeout;
+    clock_type::time_point expired_at;
+    std::atomic<bool> expired{false};
+};
+
+static bool fail(const std::string &why) {
+    std::cerr << "  " << why << std::endl;
+    return false;
+}
+
+static double us(const clock_type::duration &d) {
+    return std::chrono::duration<double, std::micro>(d).count();
+}
+
+static bool wait_for_expiry(const std::vector<std::shared_ptr<Stamp>> &stamps,
+                            const std::chrono::milliseconds &limit) {
+    auto deadline = clock_type::now() + limit;
+    for (auto &s : stamps) {
+        while (!s->expired) {
+            if (clock_type::now() > deadline) {
+                return false;
+            }
+            std::this_thread::sleep_for(1ms);
+        }
+    }
+    return true;
+}
+
+// Adds the timers and checks none expires early or later than max_late
+static bool check_expiry(TimerWheel &wheel,
+                         const std::vector<std::chrono::microseconds> &timeouts,
+                         const clock_type::duration &max_late) {
+    std::vector<std::shared_ptr<Stamp>> stamps;
+    for (auto &timeout : timeouts) {
+        auto s = std::make_shared<Stamp>();
+        s->timeout = timeout;
+        s->added_at = clock_type::now();
+        wheel.add(s, timeout);
+        stamps.push_back(s);
+    }
+
+    auto longest = *std::max_element(timeouts.begin(), timeouts.end());
+    if (!wait_for_expiry(stamps, std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     longest + 1s))) {
+        return fail("timer didn't expire");
+    }
+
+    bool ok = true;
+    for (auto &s : stamps) {
+        auto late = s->expired_at - s->added_at - s->timeout;
+        if ((late < clock_type::duration::zero()) || (late > max_late)) {
+            ok = fail(std::to_string(s->timeout.count()) + "us timer expired " +
+                      std::to_string(us(late)) + "us late");
+        }
+    }
+    if (wheel.size() != 0) {
+        ok = fail("wheel not empty");
+    }
+    return ok;
+}
+
+// Threads keep adding timers while the wheel is busy expiring others, so
+// some are added just as it turns, and some are due within the current tick.
+// None may be early, and the bulk must be within a few ticks of their
+// deadline: a timer put in a slot which has already been expired waits a
+// whole turn of the lowest level (6.4ms).
+static bool expiry_accuracy() {
+    TimerWheel wheel;
+    const unsigned threads = 8, per_thread = 500;
+    std::vector<std::vector<std::shared_ptr<Stamp>>> stamps(threads);
+
+    std::vector<std::thread> adders;
+    for (unsigned t = 0; t < threads; ++t) {
+        adders.emplace_back([&, t] {
+            std::mt19937 rng(t);
+            for (unsigned i = 0; i < per_thread; ++i) {
+                auto s = std::make_shared<Stamp>();
+                s->timeout = std::chrono::microseconds(1 + rng() % 10000);
+                s->added_at = clock_type::now();
+                wheel.add(s, s->timeout);
+                stamps[t].push_back(s);
+                std::this_thread::sleep_for(std::chrono::microseconds(rng() % 200));
+            }
+        });
+    }
+    for (auto &t : adders) {
+        t.join();
+    }
+
+    std::vector<std::shared_ptr<Stamp>> all;
+    for (auto &v : stamps) {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    if (!wait_for_expiry(all, 5s)) {
+        return fail("timer didn't expire");
+    }
+
+    std::vector<int64_t> late_ns;
+    for (auto &s : all) {
+        auto late = s->expired_at - s->added_at - s->timeout;
+        if (late < clock_type::duration::zero()) {
+            return fail("timer expired " + std::to_string(-us(late)) + "us early");
+        }
+        late_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(late).count());
+    }
+    std::sort(late_ns.begin(), late_ns.end());
+    double p50 = late_ns[late_ns.size() / 2] / 1000.0;
+    double p99 = late_ns[late_ns.size() * 99 / 100] / 1000.0;
+    std::cout << "  late p50 " << p50 << "us p99 " << p99 << "us" << std::endl;
+
+    if (p99 >= 6400) {
+        return fail("p99 lateness is a turn of the wheel");
+    }
+    return wheel.size() == 0 ? true : fail("wheel not empty");
+}
+
+// The canceller and the timer share a lock, as the queues' waiters do.
+// Once cancel() has returned under the lock, expire() mustn't take effect,
+// whichever of them got there first. The wheel must let go of every timer.
+static bool cancel_races_expire() {
+    class Racer : public TimerWheel::Timer {
+    public:
+        explicit Racer(std::mutex &m) : m(m) {}
+
+        void expire() override {
+            std::unique_lock<std::mutex> lock(m);
+            if (!is_cancelled()) {
+                fired = true;
+            }
+        }
+
+        bool fired = false;
+        bool fired_before_cancel = false;
+
+    private:
+        std::mutex &m;
+    };
+
+    TimerWheel wheel(10us);
+    std::mutex m;
+    const unsigned threads = 8, per_thread = 2000;
+    std::vector<std::vector<std::shared_ptr<Racer>>> racers(threads);
+    std::vector<std::weak_ptr<Racer>> released;
+
+    std::vector<std::thread> cancellers;
+    for (unsigned t = 0; t < threads; ++t) {
+        cancellers.emplace_back([&, t] {
+            std::mt19937 rng(t);
+            for (unsigned i = 0; i < per_thread; ++i) {
+                auto r = std::make_shared<Racer>(m);
+                wheel.add(r, std::chrono::microseconds(10 + rng() % 50));
+                std::this_thread::sleep_for(std::chrono::microseconds(rng() % 60));
+                std::unique_lock<std::mutex> lock(m);
+                wheel.cancel(*r);
+                r->fired_before_cancel = r->fired;
+                racers[t].push_back(r);
+            }
+        });
+    }
+    for (auto &t : cancellers) {
+        t.join();
+    }
+
+    // expire() may still be running for the last few
+    std::this_thread::sleep_for(50ms);
+
+    unsigned fired = 0;
+    for (auto &v : racers) {
+        for (auto &r : v) {
+            std::unique_lock<std::mutex> lock(m);
+            if (r->fired != r->fired_before_cancel) {
+                return fail("timer expired after it was cancelled");
+            }
+            fired += r->fired;
+            released.push_back(r);
+        }
+    }
+    std::cout << "  " << fired << " of " << threads * per_thread
+              << " expired before being cancelled" << std::endl;
+
+    racers.clear();
+    for (auto &w : released) {
+        if (!w.expired()) {
+            return fail("wheel kept a cancelled timer");
+        }
+    }
+    return wheel.size() == 0 ? true : fail("wheel not empty");
+}
+
+// With a 1us tick, the slots of levels 1 to 3 span 64us, 4ms and 262ms, so
+// these deadlines are placed in each level and cascade down through the
+// ones below.
+static bool cascades() {
+    TimerWheel wheel(1us);
+    return check_expiry(wheel, { 30us, 1000us, 20000us, 500000us, 1500000us }, 5ms);
+}
+
+// With a 100ns tick the whole wheel spans 1.68s. Longer deadlines are parked
+// in the top level's furthest slot and placed again when it cascades, the
+// last one twice.
+static bool beyond_top_level() {
+    TimerWheel wheel(100ns);
+    return check_expiry(wheel, { 10us, 1700000us, 2500000us, 3500000us }, 5ms);
+}
+
+int main() {
+    static const std::vector<std::pair<std::string, std::function<bool()>>> checks = {
+        { "expiry_accuracy", expiry_accuracy },
+        { "cancel_races_expire", cancel_races_expire },
+        { "cascades", cascades },
+        { "beyond_top_level", beyond_top_level }
+    };
+
+    bool failed = false;
+    for (auto &c : checks) {
+        std::cout << c.first << std::endl;
+        if (c.second()) {
+            std::cout << "  ok" << std::endl;
+        } else {
+            std::cout << "  FAILED" << std::endl;
+            failed = true;
+        }
+    }
+    return failed ? 1 : 0;
+}
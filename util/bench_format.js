@@ -0,0 +1,140 @@
+"use strict";
+
+// The records are produced by the addon itself, from PUSH_DATA packets
+// injected as if they came from the forwarder, so it must be built with
+// --simulate (grunt build --simulate).
+
+const lora_comms = require('..'),
+      crypto = require('crypto'),
+      { push_data } = require('../test/fixtures/gwmp'),
+      argv = require('yargs').command(
+          '$0',
+          'Compare the size and decoding cost of GWMP and binary uplink packets')
+          .option('n', {
+              alias: 'frames',
+              type: 'number',
+              default: 20000,
+              describe: 'number of frames to decode'
+          })
+          .option('s', {
+              alias: 'size',
+              type: 'number',
+              default: 32,
+              describe: 'PHYPayload size in bytes'
+          })
+          .argv,
+      LoRaComms = lora_comms.LoRaComms,
+      fwd_uplink = -1 - LoRaComms.uplink;
+
+function rxpk(data)
+{
+    return {
+        time: new Date().toISOString(),
+        tmst: crypto.randomBytes(4).readUInt32LE(0),
+        chan: 2,
+        rfch: 0,
+        freq: 868.1,
+        stat: 1,
+        modu: 'LORA',
+        datr: 'SF7BW125',
+        codr: '4/5',
+        rssi: -35,
+        lsnr: 5.1,
+        size: data.length,
+        data: data.toString('base64')
+    };
+}
+
+function send(link, data)
+{
+    return new Promise((resolve, reject) =>
+    {
+        LoRaComms.send_to(link, data, -1, -1, -1, (err, r) =>
+        {
+            if (err) { return reject(err); }
+            resolve(r);
+        });
+    });
+}
+
+function recv(link)
+{
+    return new Promise((resolve, reject) =>
+    {
+        const buf = Buffer.alloc(LoRaComms.recv_from_buflen);
+        LoRaComms.recv_from(link, buf, -1, -1, (err, r) =>
+        {
+            if (err) { return reject(err); }
+            resolve(buf.slice(0, r));
+        });
+    });
+}
+
+// Passes each PUSH_DATA packet through the addon in binary format and
+// collects the record it delivers. The addon acknowledges each one itself.
+async function records(packets)
+{
+    lora_comms.start({ no_streams: true, format: 'binary' });
+
+    const r = [];
+    for (let p of packets)
+    {
+        await send(fwd_uplink, p);
+        r.push(await recv(LoRaComms.uplink));
+        await recv(fwd_uplink);
+    }
+
+    await new Promise(resolve =>
+    {
+        lora_comms.once('stop', resolve);
+        lora_comms.stop();
+    });
+
+    return r;
+}
+
+function time(name, packets, decode)
+{
+    let bytes = 0, check = 0;
+    for (let p of packets)
+    {
+        bytes += p.length;
+    }
+
+    const start = process.hrtime();
+    for (let p of packets)
+    {
+        check += decode(p).rssi;
+    }
+    const [s, ns] = process.hrtime(start);
+    const us = (s * 1e9 + ns) / 1e3 / packets.length;
+
+    console.log(`${name}: ${(bytes / packets.length).toFixed(1)} bytes/frame, ` +
+                `${us.toFixed(3)} us/frame, ${Math.round(1e6 / us)} frames/s`);
+    return check;
+}
+
+(async () =>
+{
+    const gwmp = [];
+    for (let i = 0; i < argv.frames; ++i)
+    {
+        gwmp.push(push_data({ rxpk: [rxpk(crypto.randomBytes(argv.size))] }));
+    }
+
+    const binary = await records(gwmp);
+    if (lora_comms.format_stats.records !== argv.frames)
+    {
+        throw new Error('addon didn\'t deliver a record for every frame');
+    }
+
+    // Decode to the same information: the metadata and the PHYPayload bytes
+    time('gwmp', gwmp, p =>
+    {
+        const r = JSON.parse(p.slice(12)).rxpk[0];
+        r.data = Buffer.from(r.data, 'base64');
+        return r;
+    });
+
+    time('binary', binary, p => lora_comms.decode_uplink_record(p));
+})();